@@ -0,0 +1,49 @@
+#include "barnes_hut.h"
+#include <tbb/parallel_for.h>
+
+// nodes with more particles than this aggregate their children in parallel
+static constexpr uint32_t parallel_threshold = 2048;
+
+void BarnesHut::build(const glm::vec3 *position, const glm::vec3 *moment, size_t n) {
+    tree.leaf_size = leaf_size;
+    tree.build(position, n);
+    aggregates.resize(tree.nodes.size());
+    if (n > 0) {
+        aggregate(0, position, moment);
+    }
+}
+
+void BarnesHut::aggregate(uint32_t node, const glm::vec3 *position, const glm::vec3 *moment) {
+    const auto &cell = tree.nodes[node];
+    auto &agg = aggregates[node];
+    agg.moment = glm::dvec3(0.0);
+    agg.weight = 0.0;
+    glm::dvec3 centroid(0.0);
+    if (cell.is_leaf()) {
+        for (uint32_t i = cell.begin; i < cell.end; i++) {
+            auto s = tree.index[i];
+            glm::dvec3 m(moment[s]);
+            double w = glm::length(m);
+            agg.moment += m;
+            agg.weight += w;
+            centroid += w * glm::dvec3(position[s]);
+        }
+    } else {
+        if (cell.size() > parallel_threshold) {
+            tbb::parallel_for(cell.first_child, cell.first_child + cell.n_children,
+                              [=](uint32_t c) { aggregate(c, position, moment); });
+        } else {
+            for (uint32_t c = cell.first_child; c < cell.first_child + cell.n_children; c++) {
+                aggregate(c, position, moment);
+            }
+        }
+        for (uint32_t c = cell.first_child; c < cell.first_child + cell.n_children; c++) {
+            const auto &child = aggregates[c];
+            agg.moment += child.moment;
+            agg.weight += child.weight;
+            centroid += child.weight * child.position;
+        }
+    }
+    agg.position = agg.weight > 0.0 ? centroid / agg.weight : cell.center;
+    agg.radius = cell.radius + glm::length(agg.position - cell.center);
+}
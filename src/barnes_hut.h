@@ -0,0 +1,55 @@
+#pragma once
+
+#include "octree.h"
+#include <vector>
+
+// Barnes-Hut tree over point dipoles. Every cell stores the sum of its dipole moments placed at the moment weighted
+// centroid, and a cell is treated as a single dipole once it is small enough as seen from the target.
+class BarnesHut {
+  public:
+    double theta = 0.5;  // opening angle, a cell of edge length s at distance d is accepted when s / d < theta
+    double cutoff = 0.0; // cells that may contain a particle closer than this are always opened
+    size_t leaf_size = 16;
+
+    void build(const glm::vec3 *position, const glm::vec3 *moment, size_t n);
+
+    // Calls far(position, moment) for every accepted cell and near(s) for every particle of an opened leaf.
+    template <class Far, class Near>
+    void for_each_source(const glm::dvec3 &rt, Far &&far, Near &&near) const {
+        if (tree.nodes.empty()) {
+            return;
+        }
+        uint32_t stack[64 * 8];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            uint32_t node = stack[--top];
+            const auto &cell = tree.nodes[node];
+            const auto &agg = aggregates[node];
+            double d = glm::length(rt - agg.position);
+            if (2.0 * cell.half_size < theta * d && d - agg.radius >= cutoff) {
+                far(agg.position, agg.moment);
+            } else if (cell.is_leaf()) {
+                for (uint32_t i = cell.begin; i < cell.end; i++) {
+                    near(tree.index[i]);
+                }
+            } else {
+                for (uint32_t c = cell.first_child; c < cell.first_child + cell.n_children; c++) {
+                    stack[top++] = c;
+                }
+            }
+        }
+    }
+    const Octree &get_tree() const { return tree; }
+
+  private:
+    struct Aggregate {
+        glm::dvec3 position; // moment weighted centroid
+        glm::dvec3 moment;   // sum of the dipole moments
+        double weight = 0.0; // sum of |moment|
+        double radius = 0.0; // bound on the distance from position to any particle in the cell
+    };
+    Octree tree;
+    std::vector<Aggregate> aggregates;
+    void aggregate(uint32_t node, const glm::vec3 *position, const glm::vec3 *moment);
+};
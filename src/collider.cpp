@@ -0,0 +1,122 @@
+#include "collider.h"
+#include <algorithm>
+#include <igl/signed_distance.h>
+#include <tbb/parallel_for.h>
+
+void Collider::add_mesh(const Eigen::MatrixXd &V, const Eigen::MatrixXi &F, bool container) {
+    meshes.push_back({V, F, container});
+    grid_valid = false;
+}
+
+void Collider::clear() {
+    meshes.clear();
+    grid.clear();
+    grid_valid = false;
+}
+
+Eigen::VectorXd Collider::solid_distance(const Eigen::MatrixXd &P) const {
+    Eigen::VectorXd d = Eigen::VectorXd::Constant(P.rows(), band);
+    for (auto &mesh : meshes) {
+        Eigen::VectorXd S;
+        Eigen::VectorXi I;
+        Eigen::MatrixXd C, N;
+        igl::signed_distance(P, mesh.V, mesh.F, igl::SIGNED_DISTANCE_TYPE_WINDING_NUMBER, S, I, C, N);
+        // negative inside the mesh, the solid of a container is its outside
+        d = d.cwiseMin(mesh.container ? -S : S);
+    }
+    return d.cwiseMax(-band);
+}
+
+void Collider::prepare() {
+    if (grid_valid && grid_cell_size == cell_size && grid_band == band)
+        return;
+    grid_cell_size = cell_size;
+    grid_band = band;
+    grid_valid = true;
+    if (meshes.empty())
+        return;
+    Eigen::RowVector3d lo = meshes[0].V.colwise().minCoeff(), hi = meshes[0].V.colwise().maxCoeff();
+    for (auto &mesh : meshes) {
+        lo = lo.cwiseMin(mesh.V.colwise().minCoeff());
+        hi = hi.cwiseMax(mesh.V.colwise().maxCoeff());
+    }
+    lo.array() -= band + cell_size;
+    hi.array() += band + cell_size;
+    dims = glm::max(glm::ivec3(glm::ceil(glm::dvec3(hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]) / cell_size)) + 1,
+                    glm::ivec3(2));
+    origin = glm::vec3(lo[0], lo[1], lo[2]);
+    inv_cell = float(1.0 / cell_size);
+    auto position = [&](const glm::ivec3 &c) -> Eigen::RowVector3d {
+        return lo + Eigen::RowVector3d(c.x, c.y, c.z) * cell_size;
+    };
+
+    // Narrow band: the distance is first taken on every stride-th node. The distance changes by at most the length
+    // moved, so fine nodes whose nearest coarse node is farther from the surface than band plus that length keep
+    // the coarse sign at +-band and only the others are evaluated exactly.
+    constexpr int stride = 4;
+    const glm::ivec3 coarse_dims = (dims - 1 + stride - 1) / stride + 1;
+    Eigen::MatrixXd P((size_t)coarse_dims.x * coarse_dims.y * coarse_dims.z, 3);
+    for (int z = 0; z < coarse_dims.z; z++)
+        for (int y = 0; y < coarse_dims.y; y++)
+            for (int x = 0; x < coarse_dims.x; x++)
+                P.row(x + coarse_dims.x * ((size_t)y + coarse_dims.y * z)) = position(glm::ivec3(x, y, z) * stride);
+    const Eigen::VectorXd coarse = solid_distance(P);
+    const double margin = band + stride * cell_size;
+    std::vector<float> sdf((size_t)dims.x * dims.y * dims.z);
+    std::vector<size_t> near;
+    for (int z = 0; z < dims.z; z++) {
+        for (int y = 0; y < dims.y; y++) {
+            for (int x = 0; x < dims.x; x++) {
+                const glm::ivec3 c = glm::min((glm::ivec3(x, y, z) + stride / 2) / stride, coarse_dims - 1);
+                const double d = coarse[c.x + coarse_dims.x * ((size_t)c.y + coarse_dims.y * c.z)];
+                if (std::abs(d) < margin)
+                    near.push_back(node(x, y, z));
+                else
+                    sdf[node(x, y, z)] = float(d < 0.0 ? -band : band);
+            }
+        }
+    }
+    P.resize(near.size(), 3);
+    for (size_t i = 0; i < near.size(); i++) {
+        const size_t j = near[i], xy = (size_t)dims.x * dims.y;
+        P.row(i) = position(glm::ivec3(j % dims.x, j % xy / dims.x, j / xy));
+    }
+    const Eigen::VectorXd exact = solid_distance(P);
+    for (size_t i = 0; i < near.size(); i++)
+        sdf[near[i]] = float(exact[i]);
+
+    // gradient by central differences, one sided on the faces of the grid
+    grid.resize(sdf.size());
+    tbb::parallel_for(0, dims.z, [&](int z) {
+        for (int y = 0; y < dims.y; y++) {
+            for (int x = 0; x < dims.x; x++) {
+                const glm::ivec3 c(x, y, z);
+                glm::vec3 g;
+                for (int i = 0; i < 3; i++) {
+                    glm::ivec3 a = c, b = c;
+                    a[i] = std::max(c[i] - 1, 0);
+                    b[i] = std::min(c[i] + 1, dims[i] - 1);
+                    g[i] = (sdf[node(b.x, b.y, b.z)] - sdf[node(a.x, a.y, a.z)]) /
+                           (float(b[i] - a[i]) * float(cell_size));
+                }
+                grid[node(x, y, z)] = {g, sdf[node(x, y, z)]};
+            }
+        }
+    });
+}
+
+float Collider::distance(const glm::vec3 &p, glm::vec3 &gradient) const {
+    const glm::vec3 g = glm::clamp((p - origin) * inv_cell, glm::vec3(0.0f), glm::vec3(dims - 1));
+    const glm::ivec3 c = glm::min(glm::ivec3(g), dims - 2);
+    const glm::vec3 t = g - glm::vec3(c);
+    float d = 0.0f;
+    gradient = glm::vec3(0.0f);
+    for (int k = 0; k < 8; k++) {
+        int dx = k & 1, dy = (k >> 1) & 1, dz = k >> 2;
+        float w = (dx ? t.x : 1.0f - t.x) * (dy ? t.y : 1.0f - t.y) * (dz ? t.z : 1.0f - t.z);
+        const Node &n = grid[node(c.x + dx, c.y + dy, c.z + dz)];
+        d += w * n.distance;
+        gradient += w * n.gradient;
+    }
+    return d;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <cmath>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Static collision geometry given as closed triangle meshes. The signed distance to the solid (negative inside it)
+// and its gradient are baked once on a regular grid, exact within `band` of the surface and clamped to +-band
+// beyond, so resolving a contact is a single trilinear lookup whatever the number of triangles.
+// A mesh is either an obstacle, solid inside, or a container that keeps the fluid inside and is solid outside; the
+// solids of several meshes are united.
+class Collider {
+  public:
+    double cell_size = 0.005;
+    double band = 0.04;
+
+    void add_mesh(const Eigen::MatrixXd &V, const Eigen::MatrixXi &F, bool container = false);
+    void clear();
+    bool empty() const { return meshes.empty(); }
+    // bakes the grid if a mesh or the resolution changed, must be called before collide
+    void prepare();
+
+    // distance to the solid at p and its gradient (not normalized), with p clamped to the grid
+    float distance(const glm::vec3 &p, glm::vec3 &gradient) const;
+    // moves p out of the solid along the gradient and reflects the velocity into it with the given restitution.
+    // Deeper than band the baked distance is flat and gives no direction, p then goes back to previous, a position
+    // outside the solid, and the velocity is reversed.
+    void collide(glm::vec3 &p, glm::vec3 &v, float restitution, const glm::vec3 &previous) const {
+        glm::vec3 g;
+        const float d = distance(p, g);
+        if (d >= 0.0f)
+            return;
+        const float g2 = glm::dot(g, g);
+        if (g2 == 0.0f) {
+            p = previous;
+            v *= -restitution;
+            return;
+        }
+        const glm::vec3 n = g / std::sqrt(g2);
+        p -= d * n;
+        const float vn = glm::dot(v, n);
+        if (vn < 0.0f)
+            v -= (1.0f + restitution) * vn * n;
+    }
+
+  private:
+    struct Mesh {
+        Eigen::MatrixXd V;
+        Eigen::MatrixXi F;
+        bool container;
+    };
+    std::vector<Mesh> meshes;
+    bool grid_valid = false;
+    double grid_cell_size = 0.0, grid_band = 0.0;
+    glm::vec3 origin;
+    float inv_cell = 0.0f;
+    glm::ivec3 dims;
+    struct Node {
+        glm::vec3 gradient;
+        float distance;
+    };
+    std::vector<Node> grid;
+
+    // signed distance to the solid of every row of P, clamped to +-band
+    Eigen::VectorXd solid_distance(const Eigen::MatrixXd &P) const;
+    size_t node(int x, int y, int z) const { return x + dims.x * ((size_t)y + dims.y * (size_t)z); }
+};
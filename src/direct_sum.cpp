@@ -0,0 +1,185 @@
+#include "direct_sum.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+static constexpr int lanes = 16;
+static constexpr float inv_4pi = float(1.0 / (4.0 * 3.1415926535897));
+
+// the 6 distinct entries xx, xy, xz, yy, yz, zz of sum_s dH/dx over count sources (a multiple of lanes)
+SIMD_CLONES
+static void gradient_tile(float tx, float ty, float tz, const float *x, const float *y, const float *z,
+                          const float *mx, const float *my, const float *mz, size_t count, float cutoff2,
+                          double out[6]) {
+    float acc[6][lanes] = {};
+    for (size_t i = 0; i < count; i += lanes) {
+        for (int l = 0; l < lanes; l++) {
+            const size_t s = i + l;
+            const float rx = tx - x[s], ry = ty - y[s], rz = tz - z[s];
+            const float r2 = rx * rx + ry * ry + rz * rz;
+            const float inv_r = float(r2 >= cutoff2) * float(r2 > 0.0f) / std::sqrt(r2 + 1e-30f);
+            const float nx = rx * inv_r, ny = ry * inv_r, nz = rz * inv_r;
+            const float k = 3.0f * inv_4pi * inv_r * inv_r * inv_r * inv_r;
+            const float mn = mx[s] * nx + my[s] * ny + mz[s] * nz;
+            const float c = -5.0f * mn;
+            acc[0][l] += (mn + c * nx * nx + 2.0f * mx[s] * nx) * k;
+            acc[1][l] += (c * nx * ny + mx[s] * ny + nx * my[s]) * k;
+            acc[2][l] += (c * nx * nz + mx[s] * nz + nx * mz[s]) * k;
+            acc[3][l] += (mn + c * ny * ny + 2.0f * my[s] * ny) * k;
+            acc[4][l] += (c * ny * nz + my[s] * nz + ny * mz[s]) * k;
+            acc[5][l] += (mn + c * nz * nz + 2.0f * mz[s] * nz) * k;
+        }
+    }
+    for (int c = 0; c < 6; c++) {
+        double sum = 0.0;
+        for (int l = 0; l < lanes; l++) {
+            sum += acc[c][l];
+        }
+        out[c] += sum;
+    }
+}
+
+// sum_s H over count sources (a multiple of lanes)
+SIMD_CLONES
+static void field_tile(float tx, float ty, float tz, const float *x, const float *y, const float *z, const float *mx,
+                       const float *my, const float *mz, size_t count, float cutoff2, double out[3]) {
+    float acc[3][lanes] = {};
+    for (size_t i = 0; i < count; i += lanes) {
+        for (int l = 0; l < lanes; l++) {
+            const size_t s = i + l;
+            const float rx = tx - x[s], ry = ty - y[s], rz = tz - z[s];
+            const float r2 = rx * rx + ry * ry + rz * rz;
+            const float inv_r = float(r2 >= cutoff2) * float(r2 > 0.0f) / std::sqrt(r2 + 1e-30f);
+            const float nx = rx * inv_r, ny = ry * inv_r, nz = rz * inv_r;
+            const float k = inv_4pi * inv_r * inv_r * inv_r;
+            const float mn3 = 3.0f * (mx[s] * nx + my[s] * ny + mz[s] * nz);
+            acc[0][l] += (mn3 * nx - mx[s]) * k;
+            acc[1][l] += (mn3 * ny - my[s]) * k;
+            acc[2][l] += (mn3 * nz - mz[s]) * k;
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        double sum = 0.0;
+        for (int l = 0; l < lanes; l++) {
+            sum += acc[c][l];
+        }
+        out[c] += sum;
+    }
+}
+
+void DipoleDirect::load(const glm::vec3 *position, const glm::vec3 *moment, size_t n) {
+    padded = (n + lanes - 1) / lanes * lanes;
+    for (auto *v : {&x, &y, &z, &mx, &my, &mz}) {
+        v->assign(padded, 0.0f);
+    }
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        x[i] = position[i].x;
+        y[i] = position[i].y;
+        z[i] = position[i].z;
+        mx[i] = moment[i].x;
+        my[i] = moment[i].y;
+        mz[i] = moment[i].z;
+    });
+}
+
+void DipoleDirect::near_pairs(const glm::vec3 *position, size_t n, const NearField &near) {
+    if (!near || cutoff <= 0.0 || n == 0) {
+        return;
+    }
+    // counting sort into cells of size cutoff, the pair test matches the mask of the tile kernels exactly
+    const float cell = float(cutoff), cutoff2 = cell * cell;
+    glm::vec3 lo = position[0], hi = position[0];
+    for (size_t i = 1; i < n; i++) {
+        lo = glm::min(lo, position[i]);
+        hi = glm::max(hi, position[i]);
+    }
+    const glm::ivec3 dims = glm::ivec3(glm::floor((hi - lo) / cell)) + 1;
+    auto get_cell = [&](const glm::vec3 &p) {
+        return glm::clamp(glm::ivec3(glm::floor((p - lo) / cell)), glm::ivec3(0), dims - 1);
+    };
+    auto linear = [&](const glm::ivec3 &c) { return c.x + dims.x * ((size_t)c.y + dims.y * (size_t)c.z); };
+    std::vector<uint32_t> particle_cell(n);
+    cell_start.assign((size_t)dims.x * dims.y * dims.z + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        particle_cell[i] = (uint32_t)linear(get_cell(position[i]));
+        cell_start[particle_cell[i] + 1]++;
+    }
+    for (size_t c = 1; c < cell_start.size(); c++) {
+        cell_start[c] += cell_start[c - 1];
+    }
+    sorted.resize(n);
+    std::vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+    for (size_t i = 0; i < n; i++) {
+        sorted[fill[particle_cell[i]]++] = (uint32_t)i;
+    }
+    tbb::parallel_for(size_t(0), n, [&](size_t t) {
+        const glm::ivec3 c = get_cell(position[t]);
+        for (int dz = -1; dz <= 1; dz++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    glm::ivec3 d = c + glm::ivec3(dx, dy, dz);
+                    if (glm::any(glm::lessThan(d, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(d, dims)))
+                        continue;
+                    size_t k = linear(d);
+                    for (uint32_t j = cell_start[k]; j < cell_start[k + 1]; j++) {
+                        uint32_t s = sorted[j];
+                        if (s == t)
+                            continue;
+                        const glm::vec3 r = position[t] - position[s];
+                        const float r2 = r.x * r.x + r.y * r.y + r.z * r.z;
+                        if (r2 < cutoff2)
+                            near((uint32_t)t, s);
+                    }
+                }
+            }
+        }
+    });
+}
+
+void DipoleDirect::evaluate(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                            Eigen::Matrix3d *grad) {
+    load(position, moment, n);
+    const float cutoff2 = float(cutoff) * float(cutoff);
+    auto block = [&](const tbb::blocked_range<size_t> &range) {
+        double acc[target_block][6] = {};
+        for (size_t begin = 0; begin < padded; begin += tile_size) {
+            const size_t count = std::min(tile_size, padded - begin);
+            for (size_t t = range.begin(); t < range.end(); t++) {
+                gradient_tile(x[t], y[t], z[t], &x[begin], &y[begin], &z[begin], &mx[begin], &my[begin], &mz[begin],
+                              count, cutoff2, acc[t - range.begin()]);
+            }
+        }
+        for (size_t t = range.begin(); t < range.end(); t++) {
+            const double *T = acc[t - range.begin()];
+            grad[t] << T[0], T[1], T[2], T[1], T[3], T[4], T[2], T[4], T[5];
+        }
+    };
+    // the simple partitioner keeps every range within target_block
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, target_block), block, tbb::simple_partitioner());
+    near_pairs(position, n, near);
+}
+
+void DipoleDirect::evaluate_field(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                                  Eigen::Vector3d *field) {
+    load(position, moment, n);
+    const float cutoff2 = float(cutoff) * float(cutoff);
+    auto block = [&](const tbb::blocked_range<size_t> &range) {
+        double acc[target_block][3] = {};
+        for (size_t begin = 0; begin < padded; begin += tile_size) {
+            const size_t count = std::min(tile_size, padded - begin);
+            for (size_t t = range.begin(); t < range.end(); t++) {
+                field_tile(x[t], y[t], z[t], &x[begin], &y[begin], &z[begin], &mx[begin], &my[begin], &mz[begin], count,
+                           cutoff2, acc[t - range.begin()]);
+            }
+        }
+        for (size_t t = range.begin(); t < range.end(); t++) {
+            const double *H = acc[t - range.begin()];
+            field[t] = Eigen::Vector3d(H[0], H[1], H[2]);
+        }
+    };
+    // the simple partitioner keeps every range within target_block
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, target_block), block, tbb::simple_partitioner());
+    near_pairs(position, n, near);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "near_pairs.h"
+#include <Eigen/Core>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Exact O(N^2) sum of the point dipole field or field gradient, with the same contract as DipoleFMM so it can serve as
+// the accuracy reference. Sources are copied once into SoA float arrays and streamed in L1 sized tiles; each tile is
+// reused by a block of targets whose per-lane float partial sums are accumulated in double after every tile.
+class DipoleDirect {
+  public:
+    static constexpr size_t tile_size = 1024; // sources per tile, 24 KB of SoA floats
+    static constexpr size_t target_block = 64;
+    double cutoff = 0.0; // pairs closer than this are handed to the near-field callback
+
+    // grad[t] = sum of dH/dx at position[t] over all sources at least cutoff away
+    void evaluate(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                  Eigen::Matrix3d *grad);
+    // field[t] = sum of H at position[t] over all sources at least cutoff away
+    void evaluate_field(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                        Eigen::Vector3d *field);
+
+  private:
+    std::vector<float> x, y, z, mx, my, mz; // padded to a multiple of the SIMD width with zero moments
+    size_t padded = 0;
+    std::vector<uint32_t> cell_start, sorted;
+
+    void load(const glm::vec3 *position, const glm::vec3 *moment, size_t n);
+    void near_pairs(const glm::vec3 *position, size_t n, const NearField &near);
+};
@@ -0,0 +1,214 @@
+#include "external_field.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <igl/winding_number.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+static constexpr size_t block_size = 64;
+static constexpr double inv_4pi = 1.0 / (4.0 * 3.1415926535897);
+
+// out holds H (3 rows) followed by the 6 distinct entries xx, xy, xz, yy, yz, zz of dH, one column per point
+SIMD_CLONES
+static void dipole_block(const double *x, const double *y, const double *z, double sx, double sy, double sz,
+                         double mx, double my, double mz, double out[9][block_size]) {
+    for (size_t l = 0; l < block_size; l++) {
+        const double rx = x[l] - sx, ry = y[l] - sy, rz = z[l] - sz;
+        const double r2 = rx * rx + ry * ry + rz * rz;
+        const double inv_r = double(r2 > 0.0) / std::sqrt(r2 + 1e-300);
+        const double nx = rx * inv_r, ny = ry * inv_r, nz = rz * inv_r;
+        const double inv_r3 = inv_r * inv_r * inv_r * inv_4pi;
+        const double inv_r4 = 3.0 * inv_r3 * inv_r;
+        const double mn = mx * nx + my * ny + mz * nz;
+        out[0][l] += (3.0 * mn * nx - mx) * inv_r3;
+        out[1][l] += (3.0 * mn * ny - my) * inv_r3;
+        out[2][l] += (3.0 * mn * nz - mz) * inv_r3;
+        const double c = -5.0 * mn;
+        out[3][l] += (mn + c * nx * nx + 2.0 * mx * nx) * inv_r4;
+        out[4][l] += (c * nx * ny + mx * ny + nx * my) * inv_r4;
+        out[5][l] += (c * nx * nz + mx * nz + nx * mz) * inv_r4;
+        out[6][l] += (mn + c * ny * ny + 2.0 * my * ny) * inv_r4;
+        out[7][l] += (c * ny * nz + my * nz + ny * mz) * inv_r4;
+        out[8][l] += (mn + c * nz * nz + 2.0 * mz * nz) * inv_r4;
+    }
+}
+
+void add_dipole_field(const glm::dvec3 &source, const glm::dvec3 &m, const glm::vec3 *position, size_t n,
+                      glm::vec3 *H, glm::mat3 *dH) {
+    add_dipole_field(&source, &m, 1, position, n, H, dH);
+}
+
+void add_dipole_field(const glm::dvec3 *source, const glm::dvec3 *m, size_t n_sources, const glm::vec3 *position,
+                      size_t n, glm::vec3 *H, glm::mat3 *dH) {
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, block_size), [&](const tbb::blocked_range<size_t> &range) {
+        double x[block_size], y[block_size], z[block_size];
+        double out[9][block_size];
+        for (size_t begin = range.begin(); begin < range.end(); begin += block_size) {
+            const size_t count = std::min(block_size, range.end() - begin);
+            for (size_t l = 0; l < block_size; l++) {
+                // unused tail lanes repeat the first point and are not written back
+                const glm::vec3 &p = position[begin + (l < count ? l : 0)];
+                x[l] = p.x;
+                y[l] = p.y;
+                z[l] = p.z;
+            }
+            std::fill(&out[0][0], &out[0][0] + 9 * block_size, 0.0);
+            for (size_t s = 0; s < n_sources; s++) {
+                dipole_block(x, y, z, source[s].x, source[s].y, source[s].z, m[s].x, m[s].y, m[s].z, out);
+            }
+            for (size_t l = 0; l < count; l++) {
+                const size_t i = begin + l;
+                if (H) {
+                    H[i] += glm::vec3(out[0][l], out[1][l], out[2][l]);
+                }
+                if (dH) {
+                    dH[i] += glm::mat3(out[3][l], out[4][l], out[5][l], // .
+                                       out[4][l], out[6][l], out[7][l], // .
+                                       out[5][l], out[7][l], out[8][l]);
+                }
+            }
+        }
+    });
+}
+
+ExternalField::Magnet ExternalField::point_dipole(const glm::dvec3 &moment) {
+    Magnet magnet;
+    magnet.position.emplace_back(0.0);
+    magnet.moment.push_back(moment);
+    return magnet;
+}
+
+ExternalField::Magnet ExternalField::from_mesh(const Eigen::MatrixXd &V, const Eigen::MatrixXi &F,
+                                               const glm::dvec3 &magnetization, double spacing) {
+    Eigen::RowVector3d lo = V.colwise().minCoeff(), hi = V.colwise().maxCoeff();
+    Eigen::RowVector3i n = ((hi - lo) / spacing).array().ceil().cast<int>().max(1);
+    Eigen::MatrixXd P(n.prod(), 3);
+    for (int z = 0; z < n[2]; z++) {
+        for (int y = 0; y < n[1]; y++) {
+            for (int x = 0; x < n[0]; x++) {
+                P.row(x + n[0] * (y + n[1] * z)) = lo + (Eigen::RowVector3d(x, y, z).array() + 0.5).matrix() * spacing;
+            }
+        }
+    }
+    Eigen::VectorXd W;
+    igl::winding_number(V, F, P, W);
+    Magnet magnet;
+    const glm::dvec3 m = magnetization * (spacing * spacing * spacing);
+    for (Eigen::Index i = 0; i < P.rows(); i++) {
+        if (std::abs(W[i]) > 0.5) {
+            magnet.position.emplace_back(P(i, 0), P(i, 1), P(i, 2));
+            magnet.moment.push_back(m);
+        }
+    }
+    return magnet;
+}
+
+size_t ExternalField::add_magnet(Magnet magnet, const glm::dvec3 &center) {
+    magnet.center = center;
+    magnets.push_back(std::move(magnet));
+    update_sources();
+    return magnets.size() - 1;
+}
+
+void ExternalField::move_magnet(size_t i, const glm::dvec3 &center, const glm::dmat3 &rotation) {
+    if (magnets[i].center == center && magnets[i].rotation == rotation) {
+        return;
+    }
+    magnets[i].center = center;
+    magnets[i].rotation = rotation;
+    update_sources();
+}
+
+void ExternalField::clear() {
+    magnets.clear();
+    update_sources();
+}
+
+void ExternalField::update_sources() {
+    source.clear();
+    moment.clear();
+    for (auto &magnet : magnets) {
+        for (size_t i = 0; i < magnet.position.size(); i++) {
+            source.push_back(magnet.center + magnet.rotation * magnet.position[i]);
+            moment.push_back(magnet.rotation * magnet.moment[i]);
+        }
+    }
+    cache_valid = false;
+}
+
+void ExternalField::bake() {
+    cache_lower = lower;
+    cache_upper = upper;
+    cache_cell_size = cell_size;
+    dims = glm::ivec3(glm::ceil((upper - lower) / cell_size)) + 1;
+    std::vector<glm::vec3> nodes((size_t)dims.x * dims.y * dims.z);
+    tbb::parallel_for(0, dims.z, [&](int z) {
+        for (int y = 0; y < dims.y; y++) {
+            for (int x = 0; x < dims.x; x++) {
+                nodes[node(x, y, z)] = glm::vec3(lower + glm::dvec3(x, y, z) * cell_size);
+            }
+        }
+    });
+    H_grid.assign(nodes.size(), glm::vec3(0));
+    dH_grid.assign(nodes.size(), glm::mat3(0));
+    add_dipole_field(source.data(), moment.data(), source.size(), nodes.data(), nodes.size(), H_grid.data(),
+                     dH_grid.data());
+    cache_valid = true;
+}
+
+void ExternalField::evaluate(const glm::vec3 *position, size_t n, glm::vec3 *H, glm::mat3 *dH) {
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        if (H)
+            H[i] = glm::vec3(0);
+        if (dH)
+            dH[i] = glm::mat3(0);
+    });
+    if (!use_cache) {
+        add_dipole_field(source.data(), moment.data(), source.size(), position, n, H, dH);
+        return;
+    }
+    if (!cache_valid || cache_lower != lower || cache_upper != upper || cache_cell_size != cell_size) {
+        bake();
+    }
+    std::vector<uint8_t> outside(n);
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        glm::dvec3 g = (glm::dvec3(position[i]) - lower) / cell_size;
+        glm::ivec3 c = glm::ivec3(glm::floor(g));
+        if (glm::any(glm::lessThan(c, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(c, dims - 1))) {
+            outside[i] = 1;
+            return;
+        }
+        glm::vec3 t = glm::vec3(g - glm::dvec3(c));
+        for (int k = 0; k < 8; k++) {
+            int dx = k & 1, dy = (k >> 1) & 1, dz = k >> 2;
+            float w = (dx ? t.x : 1.0f - t.x) * (dy ? t.y : 1.0f - t.y) * (dz ? t.z : 1.0f - t.z);
+            size_t j = node(c.x + dx, c.y + dy, c.z + dz);
+            if (H)
+                H[i] += w * H_grid[j];
+            if (dH)
+                dH[i] += w * dH_grid[j];
+        }
+    });
+    std::vector<size_t> index;
+    std::vector<glm::vec3> points;
+    for (size_t i = 0; i < n; i++) {
+        if (outside[i]) {
+            index.push_back(i);
+            points.push_back(position[i]);
+        }
+    }
+    if (index.empty()) {
+        return;
+    }
+    std::vector<glm::vec3> H_out(points.size(), glm::vec3(0));
+    std::vector<glm::mat3> dH_out(points.size(), glm::mat3(0));
+    add_dipole_field(source.data(), moment.data(), source.size(), points.data(), points.size(), H_out.data(),
+                     dH_out.data());
+    for (size_t k = 0; k < index.size(); k++) {
+        if (H)
+            H[index[k]] = H_out[k];
+        if (dH)
+            dH[index[k]] = dH_out[k];
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Field of a point dipole m located at source, in the compact form
+//     H = (3 n (m . n) - m) / (4 pi r^3)
+//     dH_i/dx_j = 3 ((m . n)(delta_ij - 5 n_i n_j) + m_i n_j + n_i m_j) / (4 pi r^4)
+// with r = |x - source| and n = (x - source) / r. Both are zero at the source itself.
+// The points are processed in parallel blocks that are transposed to SoA so the inner loop vectorizes.
+// H and dH are accumulated into, either may be null.
+void add_dipole_field(const glm::dvec3 &source, const glm::dvec3 &m, const glm::vec3 *position, size_t n,
+                      glm::vec3 *H, glm::mat3 *dH);
+// same for the sum over n_sources dipoles
+void add_dipole_field(const glm::dvec3 *source, const glm::dvec3 *m, size_t n_sources, const glm::vec3 *position,
+                      size_t n, glm::vec3 *H, glm::mat3 *dH);
+
+// External magnetic field generated by a set of rigid magnets, each one a cloud of point dipoles.
+// The dipoles are summed directly by default. Since the magnets are static most of the time, use_cache instead bakes
+// H and dH/dx on a regular grid covering [lower, upper] and interpolates points inside it trilinearly, which costs
+// the same whatever the number of dipoles but is only second order accurate in cell_size (about 0.2% for H and 0.3%
+// for dH/dx with the default magnet and cell_size 0.02, a quarter of that at 0.01).
+// The grid is rebuilt lazily after a magnet is added or moved; points outside it are summed directly.
+class ExternalField {
+  public:
+    struct Magnet {
+        // dipoles in the magnet frame
+        std::vector<glm::dvec3> position;
+        std::vector<glm::dvec3> moment;
+        // magnet frame to world
+        glm::dvec3 center = glm::dvec3(0.0);
+        glm::dmat3 rotation = glm::dmat3(1.0);
+    };
+    // a single dipole at the magnet center
+    static Magnet point_dipole(const glm::dvec3 &moment);
+    // uniformly magnetized solid: samples the interior of a closed triangle mesh (in the magnet frame) on a grid of
+    // the given spacing, each sample carries magnetization * spacing^3
+    static Magnet from_mesh(const Eigen::MatrixXd &V, const Eigen::MatrixXi &F, const glm::dvec3 &magnetization,
+                            double spacing);
+
+    bool use_cache = false;
+    glm::dvec3 lower = glm::dvec3(0.0); // cached region
+    glm::dvec3 upper = glm::dvec3(1.0);
+    double cell_size = 0.02;
+
+    size_t add_magnet(Magnet magnet, const glm::dvec3 &center);
+    void move_magnet(size_t i, const glm::dvec3 &center, const glm::dmat3 &rotation);
+    const Magnet &magnet(size_t i) const { return magnets[i]; }
+    size_t n_magnets() const { return magnets.size(); }
+    void clear();
+
+    // overwrites H[i] and dH[i] (either may be null) with the field at position[i]
+    void evaluate(const glm::vec3 *position, size_t n, glm::vec3 *H, glm::mat3 *dH);
+
+  private:
+    std::vector<Magnet> magnets;
+    // world space dipoles of every magnet
+    std::vector<glm::dvec3> source;
+    std::vector<glm::dvec3> moment;
+    bool cache_valid = false;
+    glm::dvec3 cache_lower, cache_upper;
+    double cache_cell_size = 0.0;
+    glm::ivec3 dims;
+    std::vector<glm::vec3> H_grid;
+    std::vector<glm::mat3> dH_grid;
+
+    void update_sources();
+    void bake();
+    size_t node(int x, int y, int z) const { return x + dims.x * ((size_t)y + dims.y * (size_t)z); }
+};
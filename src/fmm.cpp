@@ -0,0 +1,362 @@
+#include "fmm.h"
+#include <cmath>
+#include <tbb/parallel_for.h>
+
+// nodes with more particles than this recurse into their children in parallel
+static constexpr uint32_t parallel_threshold = 2048;
+static constexpr double inv_4pi = 1.0 / (4.0 * 3.1415926535897);
+
+static double binomial(int n, int k) {
+    double c = 1.0;
+    for (int i = 1; i <= k; i++) {
+        c = c * (n - k + i) / i;
+    }
+    return c;
+}
+
+static inline int count_coef(int max_degree) { return (max_degree + 1) * (max_degree + 2) * (max_degree + 3) / 6; }
+
+int DipoleFMM::find(int a, int b, int c) const {
+    const int D = order + 3;
+    if (a < 0 || b < 0 || c < 0 || a >= D || b >= D || c >= D) {
+        return -1;
+    }
+    return lookup[a + D * (b + D * c)];
+}
+
+// Precomputes the multi-index tables and the flattened translation operators for the current order and derivative.
+// Notation: phi(x) = sum_k M_k a_k(x - c) for multipoles and phi(c + y) = sum_n L_n y^n for local expansions,
+// where a_k(R) = 1/k! d^k/dy^k 1/|R - y| at y = 0 are the Taylor coefficients of the Laplace kernel.
+void DipoleFMM::prepare() {
+    if (prepared_order == order && prepared_derivative == derivative) {
+        return;
+    }
+    const int D = order + 2;
+    alpha.clear();
+    degree.clear();
+    lookup.assign((D + 1) * (D + 1) * (D + 1), -1);
+    for (int deg = 0; deg <= D; deg++) {
+        for (int a = deg; a >= 0; a--) {
+            for (int b = deg - a; b >= 0; b--) {
+                int c = deg - a - b;
+                lookup[a + (D + 1) * (b + (D + 1) * c)] = (int)alpha.size();
+                alpha.push_back({a, b, c});
+                degree.push_back(deg);
+            }
+        }
+    }
+    n_coef = (int)alpha.size();
+    prepared_order = order;
+    prepared_derivative = derivative;
+    lower1.resize(n_coef);
+    lower2.resize(n_coef);
+    for (int k = 0; k < n_coef; k++) {
+        for (int i = 0; i < 3; i++) {
+            auto a = alpha[k];
+            a[i] -= 1;
+            lower1[k][i] = find(a[0], a[1], a[2]);
+            a[i] -= 1;
+            lower2[k][i] = find(a[0], a[1], a[2]);
+        }
+    }
+    auto binomial3 = [&](const std::array<int, 3> &m, const std::array<int, 3> &n) {
+        return binomial(m[0], n[0]) * binomial(m[1], n[1]) * binomial(m[2], n[2]);
+    };
+    auto leq = [](const std::array<int, 3> &a, const std::array<int, 3> &b) {
+        return a[0] <= b[0] && a[1] <= b[1] && a[2] <= b[2];
+    };
+    p2m_terms.clear();
+    m2m_terms.clear();
+    m2l_terms.clear();
+    l2l_terms.clear();
+    l2p_terms.clear();
+    // dipole source: M_k = sum_i m_i k_i d^(k - e_i)
+    for (int k = 0; k < n_coef; k++) {
+        if (degree[k] < 1 || degree[k] > order)
+            continue;
+        for (int i = 0; i < 3; i++) {
+            if (alpha[k][i] > 0) {
+                p2m_terms.push_back({k, i, lower1[k][i], (double)alpha[k][i]});
+            }
+        }
+    }
+    // M_k(parent) = sum_{j <= k} C(k, j) delta^(k - j) M_j(child)
+    for (int k = 0; k < n_coef; k++) {
+        if (degree[k] < 1 || degree[k] > order)
+            continue;
+        for (int j = 0; j < n_coef; j++) {
+            if (degree[j] < 1 || !leq(alpha[j], alpha[k]))
+                continue;
+            auto d = alpha[k];
+            for (int i = 0; i < 3; i++)
+                d[i] -= alpha[j][i];
+            m2m_terms.push_back({k, j, find(d[0], d[1], d[2]), binomial3(alpha[k], alpha[j])});
+        }
+    }
+    // L_n = (-1)^|n| sum_k C(k + n, n) M_k a_(k + n), only the terms with |n| >= derivative contribute
+    const int max_local = order + derivative - 1;
+    for (int n = 0; n < n_coef; n++) {
+        if (degree[n] < derivative || degree[n] > max_local)
+            continue;
+        for (int k = 0; k < n_coef; k++) {
+            if (degree[k] < 1 || degree[k] + degree[n] > order + derivative)
+                continue;
+            std::array<int, 3> kn = {alpha[k][0] + alpha[n][0], alpha[k][1] + alpha[n][1], alpha[k][2] + alpha[n][2]};
+            double sign = degree[n] % 2 == 0 ? 1.0 : -1.0;
+            m2l_terms.push_back({n, k, find(kn[0], kn[1], kn[2]), sign * binomial3(kn, alpha[n])});
+        }
+    }
+    // L_n(child) = sum_{m >= n} C(m, n) delta^(m - n) L_m(parent)
+    for (int n = 0; n < n_coef; n++) {
+        if (degree[n] < derivative || degree[n] > max_local)
+            continue;
+        for (int m = 0; m < n_coef; m++) {
+            if (degree[m] > max_local || !leq(alpha[n], alpha[m]))
+                continue;
+            auto d = alpha[m];
+            for (int i = 0; i < 3; i++)
+                d[i] -= alpha[n][i];
+            l2l_terms.push_back({n, m, find(d[0], d[1], d[2]), binomial3(alpha[m], alpha[n])});
+        }
+    }
+    // d phi / dx_i = sum_n L_n n_i y^(n - e_i)
+    // d^2 phi / dx_i dx_j = sum_n L_n n_i (n_j - delta_ij) y^(n - e_i - e_j)
+    for (int n = 0; n < n_coef; n++) {
+        if (degree[n] < derivative || degree[n] > max_local)
+            continue;
+        if (derivative == 1) {
+            for (int i = 0; i < 3; i++) {
+                if (alpha[n][i] > 0) {
+                    l2p_terms.push_back({i, n, lower1[n][i], (double)alpha[n][i]});
+                }
+            }
+            continue;
+        }
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                auto d = alpha[n];
+                d[i] -= 1;
+                d[j] -= 1;
+                double coef = alpha[n][i] * (alpha[n][j] - (i == j ? 1 : 0));
+                if (coef != 0.0) {
+                    l2p_terms.push_back({i * 3 + j, n, find(d[0], d[1], d[2]), coef});
+                }
+            }
+        }
+    }
+}
+
+void DipoleFMM::monomials(double *out, const glm::dvec3 &d, int max_degree) const {
+    out[0] = 1.0;
+    const int n = count_coef(max_degree);
+    for (int k = 1; k < n; k++) {
+        int i = alpha[k][0] > 0 ? 0 : (alpha[k][1] > 0 ? 1 : 2);
+        out[k] = out[lower1[k][i]] * d[i];
+    }
+}
+
+void DipoleFMM::upward(uint32_t node) {
+    const auto &cell = tree.nodes[node];
+    double *M = &multipole[(size_t)node * n_coef];
+    std::vector<double> mono(n_coef);
+    if (cell.is_leaf()) {
+        for (uint32_t i = cell.begin; i < cell.end; i++) {
+            auto s = tree.index[i];
+            monomials(mono.data(), glm::dvec3(position[s]) - cell.center, order - 1);
+            glm::dvec3 m(moment[s]);
+            for (const auto &t : p2m_terms) {
+                M[t.out] += t.coef * m[t.in] * mono[t.aux];
+            }
+        }
+        return;
+    }
+    if (cell.size() > parallel_threshold) {
+        tbb::parallel_for(cell.first_child, cell.first_child + cell.n_children, [=](uint32_t c) { upward(c); });
+    } else {
+        for (uint32_t c = cell.first_child; c < cell.first_child + cell.n_children; c++) {
+            upward(c);
+        }
+    }
+    for (uint32_t c = cell.first_child; c < cell.first_child + cell.n_children; c++) {
+        const double *Mc = &multipole[(size_t)c * n_coef];
+        monomials(mono.data(), tree.nodes[c].center - cell.center, order);
+        for (const auto &t : m2m_terms) {
+            M[t.out] += t.coef * mono[t.aux] * Mc[t.in];
+        }
+    }
+}
+
+void DipoleFMM::m2l(uint32_t target, uint32_t source) {
+    glm::dvec3 R = tree.nodes[target].center - tree.nodes[source].center;
+    double r2 = glm::dot(R, R);
+    // Taylor coefficients of 1/r by the recurrence
+    // |k| r^2 a_k - (2|k| - 1) sum_i R_i a_(k - e_i) + (|k| - 1) sum_i a_(k - 2e_i) = 0
+    std::vector<double> a(n_coef);
+    a[0] = 1.0 / std::sqrt(r2);
+    for (int k = 1; k < n_coef; k++) {
+        double s1 = 0.0, s2 = 0.0;
+        for (int i = 0; i < 3; i++) {
+            if (lower1[k][i] >= 0)
+                s1 += R[i] * a[lower1[k][i]];
+            if (lower2[k][i] >= 0)
+                s2 += a[lower2[k][i]];
+        }
+        int deg = degree[k];
+        a[k] = ((2 * deg - 1) * s1 - (deg - 1) * s2) / (deg * r2);
+    }
+    double *L = &local[(size_t)target * n_coef];
+    const double *M = &multipole[(size_t)source * n_coef];
+    for (const auto &t : m2l_terms) {
+        L[t.out] += t.coef * M[t.in] * a[t.aux];
+    }
+}
+
+void DipoleFMM::p2p(uint32_t target, uint32_t source) {
+    const auto &A = tree.nodes[target];
+    const auto &B = tree.nodes[source];
+    const double cutoff2 = cutoff * cutoff;
+    for (uint32_t i = A.begin; i < A.end; i++) {
+        auto t = tree.index[i];
+        glm::dvec3 rt(position[t]);
+        Eigen::Matrix3d U;
+        U.setZero();
+        glm::dvec3 H(0.0);
+        for (uint32_t j = B.begin; j < B.end; j++) {
+            auto s = tree.index[j];
+            if (s == t)
+                continue;
+            glm::dvec3 r = rt - glm::dvec3(position[s]);
+            double r2 = glm::dot(r, r);
+            if (r2 < cutoff2) {
+                if (*near)
+                    (*near)(t, s);
+                continue;
+            }
+            glm::dvec3 m(moment[s]);
+            double inv_r2 = 1.0 / r2;
+            double inv_r3 = inv_r2 / std::sqrt(r2);
+            double inv_r5 = inv_r3 * inv_r2;
+            double mr = glm::dot(m, r);
+            if (derivative == 1) {
+                H += 3.0 * inv_r5 * mr * r - inv_r3 * m;
+                continue;
+            }
+            for (int a = 0; a < 3; a++) {
+                for (int b = 0; b < 3; b++) {
+                    U(a, b) += 3.0 * inv_r5 * ((a == b ? mr : 0.0) + r[a] * m[b] + m[a] * r[b]) -
+                               15.0 * inv_r5 * inv_r2 * r[a] * r[b] * mr;
+                }
+            }
+        }
+        if (derivative == 1) {
+            field[t] += inv_4pi * Eigen::Vector3d(H.x, H.y, H.z);
+        } else {
+            grad[t] += inv_4pi * U;
+        }
+    }
+}
+
+void DipoleFMM::interact(uint32_t target, uint32_t source) {
+    const auto &A = tree.nodes[target];
+    const auto &B = tree.nodes[source];
+    double d = glm::length(A.center - B.center);
+    if (A.radius + B.radius < theta * d && d - A.radius - B.radius >= cutoff) {
+        m2l(target, source);
+        return;
+    }
+    if (A.is_leaf() && B.is_leaf()) {
+        p2p(target, source);
+        return;
+    }
+    // split the larger cell; distinct target cells never share output so those can run in parallel
+    if (B.is_leaf() || (!A.is_leaf() && A.radius >= B.radius)) {
+        if (A.size() > parallel_threshold) {
+            tbb::parallel_for(A.first_child, A.first_child + A.n_children,
+                              [=](uint32_t c) { interact(c, source); });
+        } else {
+            for (uint32_t c = A.first_child; c < A.first_child + A.n_children; c++) {
+                interact(c, source);
+            }
+        }
+    } else {
+        for (uint32_t c = B.first_child; c < B.first_child + B.n_children; c++) {
+            interact(target, c);
+        }
+    }
+}
+
+void DipoleFMM::downward(uint32_t node) {
+    const auto &cell = tree.nodes[node];
+    const double *L = &local[(size_t)node * n_coef];
+    std::vector<double> mono(n_coef);
+    if (cell.is_leaf()) {
+        for (uint32_t i = cell.begin; i < cell.end; i++) {
+            auto t = tree.index[i];
+            monomials(mono.data(), glm::dvec3(position[t]) - cell.center, order - 1);
+            double derivatives[9] = {};
+            for (const auto &term : l2p_terms) {
+                derivatives[term.out] += term.coef * L[term.in] * mono[term.aux];
+            }
+            // H = -grad(phi), dH/dx = -hessian(phi)
+            if (derivative == 1) {
+                for (int a = 0; a < 3; a++) {
+                    field[t][a] -= inv_4pi * derivatives[a];
+                }
+                continue;
+            }
+            for (int a = 0; a < 3; a++) {
+                for (int b = 0; b < 3; b++) {
+                    grad[t](a, b) -= inv_4pi * derivatives[a * 3 + b];
+                }
+            }
+        }
+        return;
+    }
+    for (uint32_t c = cell.first_child; c < cell.first_child + cell.n_children; c++) {
+        double *Lc = &local[(size_t)c * n_coef];
+        monomials(mono.data(), tree.nodes[c].center - cell.center, order - 1);
+        for (const auto &t : l2l_terms) {
+            Lc[t.out] += t.coef * mono[t.aux] * L[t.in];
+        }
+    }
+    if (cell.size() > parallel_threshold) {
+        tbb::parallel_for(cell.first_child, cell.first_child + cell.n_children, [=](uint32_t c) { downward(c); });
+    } else {
+        for (uint32_t c = cell.first_child; c < cell.first_child + cell.n_children; c++) {
+            downward(c);
+        }
+    }
+}
+
+void DipoleFMM::run(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near) {
+    if (n == 0) {
+        return;
+    }
+    prepare();
+    this->position = position;
+    this->moment = moment;
+    this->near = &near;
+    tree.leaf_size = leaf_size;
+    tree.build(position, n);
+    multipole.assign(tree.nodes.size() * n_coef, 0.0);
+    local.assign(tree.nodes.size() * n_coef, 0.0);
+    upward(0);
+    interact(0, 0);
+    downward(0);
+}
+
+void DipoleFMM::evaluate(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                         Eigen::Matrix3d *grad) {
+    tbb::parallel_for(size_t(0), n, [=](size_t i) { grad[i].setZero(); });
+    derivative = 2;
+    this->grad = grad;
+    run(position, moment, n, near);
+}
+
+void DipoleFMM::evaluate_field(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                               Eigen::Vector3d *field) {
+    tbb::parallel_for(size_t(0), n, [=](size_t i) { field[i].setZero(); });
+    derivative = 1;
+    this->field = field;
+    run(position, moment, n, near);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "near_pairs.h"
+#include "octree.h"
+#include <Eigen/Core>
+#include <vector>
+
+// Cartesian Taylor-series fast multipole method for the field and field gradient of a set of point dipoles.
+// The potential of a dipole m at rs is phi(x) = m . (x - rs) / (4 pi |x - rs|^3), H = -grad phi and the evaluated
+// tensor is dH_i/dx_j, which is exactly what Simulation::get_Force_Tensor computes for a single far-field pair.
+class DipoleFMM {
+  public:
+    int order = 4;       // multipole order, local expansions go up to order + 1
+    double theta = 0.5;  // opening angle of the multipole acceptance criterion
+    double cutoff = 0.0; // pairs closer than this are handed to the near-field callback
+    size_t leaf_size = 32;
+
+    // grad[t] = sum of dH/dx at position[t] over all sources at least cutoff away
+    void evaluate(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                  Eigen::Matrix3d *grad);
+    // field[t] = sum of H at position[t] over all sources at least cutoff away
+    void evaluate_field(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                        Eigen::Vector3d *field);
+    const Octree &get_tree() const { return tree; }
+
+  private:
+    struct Term {
+        int out, in, aux;
+        double coef;
+    };
+    int derivative = 2; // 1 evaluates H, 2 evaluates dH/dx
+    int prepared_order = -1;
+    int prepared_derivative = -1;
+    int n_coef = 0;                            // number of multi-indices of degree <= order + 2
+    std::vector<std::array<int, 3>> alpha;     // multi-indices sorted by degree
+    std::vector<int> degree;
+    std::vector<std::array<int, 3>> lower1;    // index of alpha - e_i, or -1
+    std::vector<std::array<int, 3>> lower2;    // index of alpha - 2 e_i, or -1
+    std::vector<int> lookup;                   // (a, b, c) -> index into alpha
+    std::vector<Term> p2m_terms, m2m_terms, m2l_terms, l2l_terms, l2p_terms;
+    Octree tree;
+    std::vector<double> multipole, local;
+    const glm::vec3 *position = nullptr;
+    const glm::vec3 *moment = nullptr;
+    const NearField *near = nullptr;
+    Eigen::Matrix3d *grad = nullptr;
+    Eigen::Vector3d *field = nullptr;
+
+    int find(int a, int b, int c) const;
+    void prepare();
+    void monomials(double *out, const glm::dvec3 &d, int max_degree) const;
+    void upward(uint32_t node);
+    void interact(uint32_t target, uint32_t source);
+    void downward(uint32_t node);
+    void run(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near);
+    void m2l(uint32_t target, uint32_t source);
+    void p2p(uint32_t target, uint32_t source);
+};
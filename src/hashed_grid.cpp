@@ -0,0 +1,42 @@
+#include "hashed_grid.h"
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+void HashedGrid::build(const glm::vec3 *position, size_t n, uint32_t *particle_cell) {
+    std::vector<std::pair<uint64_t, uint32_t>> keys(n);
+    tbb::parallel_for(size_t(0), n, [&](size_t i) { keys[i] = {key(cell(position[i])), (uint32_t)i}; });
+    tbb::parallel_sort(keys.begin(), keys.end());
+    sorted.resize(n);
+    cell_key.clear();
+    cell_start.clear();
+    for (size_t i = 0; i < n; i++) {
+        sorted[i] = keys[i].second;
+        if (i == 0 || keys[i].first != keys[i - 1].first) {
+            cell_key.push_back(keys[i].first);
+            cell_start.push_back((uint32_t)i);
+        }
+    }
+    cell_start.push_back((uint32_t)n);
+    if (particle_cell) {
+        tbb::parallel_for(size_t(0), cell_key.size(), [&](size_t c) {
+            for (uint32_t i = cell_start[c]; i < cell_start[c + 1]; i++) {
+                particle_cell[sorted[i]] = (uint32_t)c;
+            }
+        });
+    }
+    // at most half full
+    int bits = 1;
+    while ((size_t(1) << bits) < 2 * cell_key.size()) {
+        bits++;
+    }
+    table_shift = 64 - bits;
+    table_mask = (size_t(1) << bits) - 1;
+    table.assign(table_mask + 1, empty);
+    for (size_t c = 0; c < cell_key.size(); c++) {
+        size_t slot = hash(cell_key[c]);
+        while (table[slot] != empty) {
+            slot = (slot + 1) & table_mask;
+        }
+        table[slot] = (uint32_t)c;
+    }
+}
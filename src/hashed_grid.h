@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <utility>
+#include <vector>
+
+// Sparse uniform grid over an unbounded domain. Particles are sorted by the 64-bit key of their integer cell
+// coordinates and only occupied cells are stored, in an open addressing hash table keyed the same way, so memory
+// scales with the number of occupied cells instead of the extent of the scene.
+class HashedGrid {
+  public:
+    float cell_size = 0.05f;
+
+    // particle_cell, if not null, receives the index of the occupied cell of every particle
+    void build(const glm::vec3 *position, size_t n, uint32_t *particle_cell = nullptr);
+
+    glm::ivec3 cell(const glm::vec3 &p) const { return glm::ivec3(glm::floor(p / cell_size)); }
+    // 21 bits per axis, z major so that cells adjacent along x are adjacent in the sort order
+    static uint64_t key(const glm::ivec3 &c) {
+        const uint64_t mask = (1u << 21) - 1, bias = 1u << 20;
+        return ((c.x + bias) & mask) | ((c.y + bias) & mask) << 21 | ((c.z + bias) & mask) << 42;
+    }
+    // particles of cell c are particles()[range.first .. range.second), empty for unoccupied cells
+    std::pair<uint32_t, uint32_t> range(const glm::ivec3 &c) const {
+        const uint64_t k = key(c);
+        for (size_t slot = hash(k);; slot = (slot + 1) & table_mask) {
+            const uint32_t i = table[slot];
+            if (i == empty) {
+                return {0, 0};
+            }
+            if (cell_key[i] == k) {
+                return {cell_start[i], cell_start[i + 1]};
+            }
+        }
+    }
+    const uint32_t *particles() const { return sorted.data(); }
+    size_t n_cells() const { return cell_key.size(); }
+    // coordinates of the i-th occupied cell
+    glm::ivec3 cell_coord(size_t i) const {
+        const uint64_t k = cell_key[i], mask = (1u << 21) - 1;
+        const int bias = 1 << 20;
+        return glm::ivec3(int(k & mask) - bias, int(k >> 21 & mask) - bias, int(k >> 42 & mask) - bias);
+    }
+
+  private:
+    static constexpr uint32_t empty = ~0u;
+    std::vector<uint32_t> sorted;     // particle ids by cell key, ascending within a cell
+    std::vector<uint64_t> cell_key;   // occupied cells in key order
+    std::vector<uint32_t> cell_start; // one entry per occupied cell plus the end sentinel
+    std::vector<uint32_t> table;      // occupied cell index or empty
+    size_t table_mask = 0;
+    int table_shift = 64;
+
+    size_t hash(uint64_t k) const { return size_t((k * 0x9e3779b97f4a7c15ull) >> table_shift); }
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// A function of the distance r sampled at uniform steps of r^2 over [0, r_max] and interpolated linearly, so a lookup
+// costs a multiply, a truncation and one interpolation instead of a sqrt and a piecewise polynomial. Lookups past
+// r_max return 0.
+class KernelTable {
+  public:
+    static constexpr size_t resolution = 4096;
+
+    template <class F>
+    void build(float r_max, F &&f) {
+        r2_max = r_max * r_max;
+        inv_step = resolution / r2_max;
+        value.resize(resolution + 2);
+        for (size_t i = 0; i <= resolution; i++) {
+            value[i] = float(f(std::sqrt(double(i) / inv_step)));
+        }
+        // r2 just below r2_max can round up to the last node
+        value[resolution + 1] = value[resolution];
+    }
+    float operator()(float r2) const {
+        if (!(r2 < r2_max)) {
+            return 0.0f;
+        }
+        const float x = r2 * inv_step;
+        const size_t i = size_t(x);
+        return value[i] + (x - float(i)) * (value[i + 1] - value[i]);
+    }
+    float range2() const { return r2_max; }
+    // largest difference to f at the quarter points of every interval, relative to the largest |f| at the nodes. With
+    // r_power set both sides are multiplied by r^r_power first, for tables that are used scaled by a power of r.
+    template <class F>
+    double max_error(F &&f, int r_power = 0) const {
+        double scale = 0.0, error = 0.0;
+        for (size_t i = 0; i <= resolution; i++) {
+            scale = std::max(scale, std::abs(value[i] * std::pow(double(i) / inv_step, 0.5 * r_power)));
+        }
+        for (size_t i = 0; i < resolution; i++) {
+            for (double t : {0.25, 0.5, 0.75}) {
+                const double r2 = (i + t) / inv_step;
+                const double weight = std::pow(r2, 0.5 * r_power);
+                error = std::max(error, weight * std::abs(double((*this)(float(r2))) - double(f(std::sqrt(r2)))));
+            }
+        }
+        return scale > 0.0 ? error / scale : error;
+    }
+
+  private:
+    float r2_max = 0.0f, inv_step = 0.0f;
+    std::vector<float> value;
+};
@@ -4,6 +4,7 @@
 #include <atomic>
 #include <chrono>
 #include <igl/opengl/glfw/Viewer.h>
+#include <igl/read_triangle_mesh.h>
 #include <igl/writeOBJ.h>
 #include <iostream>
 #include <random>
@@ -202,10 +203,15 @@ Simulation setup_sph_wave_impact() {
     return sim;
 }
 bool write_obj_sequence = false;
+// -s writes an OBJ sequence, -c <mesh> adds an obstacle and -C <mesh> a container to the collider of the scene
 int main(int argc, char **argv) {
-    if (argc > 1) {
-        if (std::strcmp(argv[1], "-s") == 0) {
+    std::vector<std::pair<std::string, bool>> collider_meshes;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-s") == 0) {
             write_obj_sequence = true;
+        } else if ((std::strcmp(argv[i], "-c") == 0 || std::strcmp(argv[i], "-C") == 0) && i + 1 < argc) {
+            collider_meshes.emplace_back(argv[i + 1], argv[i][1] == 'C');
+            i++;
         }
     }
 
@@ -218,6 +224,15 @@ int main(int argc, char **argv) {
     // auto sim = setup_sph_fluid_crown();
     // auto sim = setup_ferro_no_interparticle();
     auto sim = setup_ferro_no_magnetic();
+    for (auto &[path, container] : collider_meshes) {
+        Eigen::MatrixXd V;
+        Eigen::MatrixXi F;
+        if (!igl::read_triangle_mesh(path, V, F)) {
+            fprintf(stderr, "cannot read %s\n", path.c_str());
+            return 1;
+        }
+        sim.collider.add_mesh(V, F, container);
+    }
 
     Eigen::MatrixXd PP;
     Eigen::MatrixXi PI;
@@ -228,39 +243,49 @@ int main(int argc, char **argv) {
     P.resize(0, 3);
     std::mutex sim_lk;
 
+    // positions and densities in the initial particle order, which the slots leave once particles are reordered.
+    // Must be called with sim_lk held.
+    auto gather = [&](Eigen::MatrixXd &X, Eigen::VectorXd *density) {
+        X.resize(sim.num_particles, 3);
+        if (density)
+            density->resize(sim.num_particles);
+        for (size_t i = 0; i < sim.num_particles; i++) {
+            const uint32_t id = sim.pointers.particle_id[i];
+            const auto p = sim.pointers.particle_position[i];
+            X.row(id) = Eigen::RowVector3d(p.x, p.y, p.z);
+            if (density)
+                (*density)[id] = sim.pointers.density[i];
+        }
+    };
     auto write_obj = [&] {
+        Eigen::MatrixXd X;
         Eigen::VectorXd mass, density;
         {
             std::lock_guard<std::mutex> lk(sim_lk);
+            gather(X, &density);
             mass.resize(sim.num_particles);
-            density.resize(sim.num_particles);
             mass.setConstant(sim.mass);
-            for (size_t i = 0; i < sim.num_particles; i++) {
-                density[i] = sim.pointers.density[i];
-            }
         }
         Eigen::MatrixXd V;
         Eigen::MatrixXi F;
-        reconstruct(V, F, P, reconstruction_res, mass, density, sim.h, reconstruction_iso);
+        reconstruct(V, F, X, reconstruction_res, mass, density, sim.h, reconstruction_iso);
         std::time_t result = std::time(nullptr);
         std::ostringstream os;
         os << "sim-" << result << ".obj";
         igl::writeOBJ(os.str(), V, F);
     };
     auto write_obj_seq = [&](size_t iter) {
+        Eigen::MatrixXd X;
         Eigen::VectorXd mass, density;
         {
             std::lock_guard<std::mutex> lk(sim_lk);
+            gather(X, &density);
             mass.resize(sim.num_particles);
-            density.resize(sim.num_particles);
             mass.setConstant(sim.mass);
-            for (size_t i = 0; i < sim.num_particles; i++) {
-                density[i] = sim.pointers.density[i];
-            }
         }
         Eigen::MatrixXd V;
         Eigen::MatrixXi F;
-        reconstruct(V, F, P, reconstruction_res, mass, density, sim.h, reconstruction_iso);
+        reconstruct(V, F, X, reconstruction_res, mass, density, sim.h, reconstruction_iso);
         printf("============== WRITE OBJ SEQUENCE =================\n");
         std::ostringstream os;
         std::time_t result = std::time(nullptr);
@@ -289,12 +314,12 @@ int main(int argc, char **argv) {
     igl::opengl::glfw::Viewer viewer;
     viewer.data().set_edges(PP, PI, Eigen::RowVector3d(1, 0.47, 0.45));
     viewer.callback_post_draw = [&](Viewer &) -> bool {
-        if (sim_ready) {
+        // retried at the next frame while a step holds the lock
+        std::unique_lock<std::mutex> lk(sim_lk, std::try_to_lock);
+        if (sim_ready && lk.owns_lock()) {
             sim_ready = false;
-            for (size_t i = 0; i < sim.buffers.num_particles; i++) {
-                auto p = sim.buffers.particle_position[i];
-                P.row(i) = Eigen::RowVector3d(p.x, p.y, p.z);
-            }
+            gather(P, nullptr);
+            lk.unlock();
             viewer.data().point_size = 5;
             viewer.data().set_points(P, Eigen::RowVector3d(1, 1, 1));
         }
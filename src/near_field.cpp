@@ -0,0 +1,155 @@
+#include "near_field.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <tbb/parallel_for.h>
+
+// C1 / C2 coefficients of the paper's appendix, highest power first, one row per unit interval of q
+static const float C1_coef[4][5] = {
+    {9.97813616438174e-09f, -2.97897856524718e-08f, 2.38918644566813e-09f, 4.53199938857366e-08f, 2.44617454752747e-11f},
+    {-2.76473728643294e-09f, 2.86975546540539e-08f, -9.94582836806651e-08f, 1.25129924573675e-07f,
+     -2.37010166723652e-08f},
+    {-1.09679990621465e-09f, 9.77055663264614e-09f, -2.54781238661150e-08f, 2.65020634884934e-09f,
+     5.00787562417835e-08f},
+    {3.79927162333632e-10f, -6.26368404962679e-09f, 3.94760528277489e-08f, -1.13580541622200e-07f,
+     1.27491333574323e-07f}};
+static const float C2_coef[4][5] = {
+    {6.69550479838731e-08f, -1.61753307173877e-07f, 1.68213714992711e-08f, 1.34558143036838e-07f, 1.10976027980100e-10f},
+    {-3.08460139955194e-08f, 2.29192245602275e-07f, -5.88399621128587e-07f, 5.61170054591844e-07f,
+     -1.14421132829680e-07f},
+    {3.50477408060213e-09f, -5.25956271895141e-08f, 2.78876509535747e-07f, -6.24199554212217e-07f,
+     4.91807818904985e-07f},
+    {7.33485346367840e-10f, -9.58855788627803e-09f, 4.37085309763591e-08f, -7.48004594092261e-08f,
+     2.34161209605651e-08f}};
+
+static inline float horner(const float *c, float q) { return q * (q * (q * (q * c[0] + c[1]) + c[2]) + c[3]) + c[4]; }
+
+static inline void eval_curves(float q, float &C1, float &C2) {
+    // piece k covers (k, k + 1], zero outside (0, 4]; all four pieces are evaluated and masked, which the batch
+    // kernel can vectorize where a table index would need gathers and a select chain would keep branches
+    const float c1[4] = {horner(C1_coef[0], q), horner(C1_coef[1], q), horner(C1_coef[2], q), horner(C1_coef[3], q)};
+    const float c2[4] = {horner(C2_coef[0], q), horner(C2_coef[1], q), horner(C2_coef[2], q), horner(C2_coef[3], q)};
+    // exactly one of the 0/1 weights is set
+    const float p0 = q > 0.0f ? 1.0f : 0.0f, p1 = q > 1.0f ? 1.0f : 0.0f, p2 = q > 2.0f ? 1.0f : 0.0f,
+                p3 = q > 3.0f ? 1.0f : 0.0f, p4 = q > 4.0f ? 1.0f : 0.0f;
+    const float w[4] = {p0 - p1, p1 - p2, p2 - p3, p3 - p4};
+    C1 = w[0] * c1[0] + w[1] * c1[1] + w[2] * c1[2] + w[3] * c1[3];
+    C2 = w[0] * c2[0] + w[1] * c2[1] + w[2] * c2[2] + w[3] * c2[3];
+}
+
+void NearFieldTensor::curves(float q, float &C1, float &C2) { eval_curves(q, C1, C2); }
+
+// accumulates the 6 distinct entries (xx, xy, xz, yy, yz, zz) of the symmetric tensor sum over sources [begin, end)
+SIMD_CLONES
+static void accumulate_batch(double out[6], float tx, float ty, float tz, const float *x, const float *y,
+                             const float *z, const float *mx, const float *my, const float *mz, size_t begin,
+                             size_t end, float inv_h) {
+    constexpr int lanes = NearFieldTensor::lanes;
+    float acc[6][lanes] = {};
+    for (size_t i = begin; i < end; i += lanes) {
+        for (int l = 0; l < lanes; l++) {
+            const size_t s = i + l;
+            const float valid = float(s < end);
+            const float rx = tx - x[s], ry = ty - y[s], rz = tz - z[s];
+            const float r = std::sqrt(rx * rx + ry * ry + rz * rz);
+            const float inv_r = float(r > 0.0f) / (r + 1e-30f);
+            const float nx = rx * inv_r, ny = ry * inv_r, nz = rz * inv_r;
+            float C1, C2;
+            eval_curves(r * inv_h, C1, C2);
+            C1 *= valid;
+            C2 *= valid;
+            const float mn = mx[s] * nx + my[s] * ny + mz[s] * nz;
+            const float px = mx[s] - mn * nx, py = my[s] - mn * ny, pz = mz[s] - mn * nz;
+            const float a = C1 * mn;
+            const float c = C2 * mn - a;
+            acc[0][l] += a + 2.0f * C1 * px * nx + c * nx * nx;
+            acc[1][l] += C1 * (px * ny + nx * py) + c * nx * ny;
+            acc[2][l] += C1 * (px * nz + nx * pz) + c * nx * nz;
+            acc[3][l] += a + 2.0f * C1 * py * ny + c * ny * ny;
+            acc[4][l] += C1 * (py * nz + ny * pz) + c * ny * nz;
+            acc[5][l] += a + 2.0f * C1 * pz * nz + c * nz * nz;
+        }
+    }
+    for (int c = 0; c < 6; c++) {
+        double sum = 0.0;
+        for (int l = 0; l < lanes; l++) {
+            sum += acc[c][l];
+        }
+        out[c] += sum;
+    }
+}
+
+glm::ivec3 NearFieldTensor::get_cell(const glm::vec3 &p) const {
+    glm::ivec3 c = glm::ivec3(glm::floor((p - lower) / (4.0f * h)));
+    return glm::clamp(c, glm::ivec3(0), dims - 1);
+}
+
+void NearFieldTensor::build(const glm::vec3 *position, const glm::vec3 *moment, size_t n) {
+    this->position = position;
+    this->n = n;
+    if (n == 0) {
+        return;
+    }
+    glm::vec3 hi = position[0];
+    lower = position[0];
+    for (size_t i = 1; i < n; i++) {
+        lower = glm::min(lower, position[i]);
+        hi = glm::max(hi, position[i]);
+    }
+    dims = glm::max(glm::ivec3(glm::floor((hi - lower) / (4.0f * h))) + 1, glm::ivec3(1));
+    const size_t n_cells = (size_t)dims.x * dims.y * dims.z;
+    std::vector<uint32_t> particle_cell(n);
+    cell_start.assign(n_cells + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        auto c = get_cell(position[i]);
+        particle_cell[i] = c.x + dims.x * (c.y + dims.y * c.z);
+        cell_start[particle_cell[i] + 1]++;
+    }
+    for (size_t c = 0; c < n_cells; c++) {
+        cell_start[c + 1] += cell_start[c];
+    }
+    sorted.resize(n);
+    {
+        std::vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            sorted[fill[particle_cell[i]]++] = (uint32_t)i;
+        }
+    }
+    for (auto *v : {&x, &y, &z, &mx, &my, &mz}) {
+        v->assign(n + lanes, 0.0f);
+    }
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        auto s = sorted[i];
+        x[i] = position[s].x;
+        y[i] = position[s].y;
+        z[i] = position[s].z;
+        mx[i] = moment[s].x;
+        my[i] = moment[s].y;
+        mz[i] = moment[s].z;
+    });
+}
+
+void NearFieldTensor::evaluate(Eigen::Matrix3d *U) const {
+    const float inv_h = 1.0f / h;
+    const double inv_h4 = 1.0 / ((double)h * h * h * h);
+    tbb::parallel_for(size_t(0), n, [&](size_t t) {
+        const glm::vec3 rt = position[t];
+        const glm::ivec3 c = get_cell(rt);
+        const int x0 = std::max(c.x - 1, 0), x1 = std::min(c.x + 1, dims.x - 1);
+        double T[6] = {};
+        // cells adjacent along x are contiguous in the sorted arrays
+        for (int dz = -1; dz <= 1; dz++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                int cy = c.y + dy, cz = c.z + dz;
+                if (cy < 0 || cz < 0 || cy >= dims.y || cz >= dims.z)
+                    continue;
+                size_t row = (size_t)dims.x * (cy + (size_t)dims.y * cz);
+                accumulate_batch(T, rt.x, rt.y, rt.z, x.data(), y.data(), z.data(), mx.data(), my.data(), mz.data(),
+                                 cell_start[row + x0], cell_start[row + x1 + 1], inv_h);
+            }
+        }
+        Eigen::Matrix3d Ts;
+        Ts << T[0], T[1], T[2], T[1], T[3], T[4], T[2], T[4], T[5];
+        U[t] += Ts * inv_h4;
+    });
+}
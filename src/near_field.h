@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Near field (r < 4h) magnetic force tensor of the paper's appendix, evaluated in closed form.
+// The appendix gives it as R T_hat R^T in a frame R whose third axis is n = (rt - rs) / |rt - rs|, with
+// T_hat = [[m3 C1, 0, m1 C1], [0, m3 C1, m2 C1], [m1 C1, m2 C1, m3 C2]] / h^4 for the rotated moment m_hat = R^T m.
+// With m_perp = m - (m . n) n that is
+//     Ts = (C1 ((m . n)(I - n n^T) + m_perp n^T + n m_perp^T) + C2 (m . n) n n^T) / h^4,
+// so no rotation frame is needed. Sources are binned into 4h cells and stored as padded SoA float arrays so that
+// batches of sources are processed in SIMD lanes.
+class NearFieldTensor {
+  public:
+    static constexpr int lanes = 16;
+    float h = 0.04f;
+
+    void build(const glm::vec3 *position, const glm::vec3 *moment, size_t n);
+    // U[t] += sum of Ts over every source within 4h of position[t]
+    void evaluate(Eigen::Matrix3d *U) const;
+
+    // the piecewise quartic C1 / C2 curves, branch free
+    static void curves(float q, float &C1, float &C2);
+
+  private:
+    glm::vec3 lower;
+    glm::ivec3 dims;
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> sorted;
+    std::vector<float> x, y, z, mx, my, mz; // sorted by cell, padded by `lanes` entries
+    const glm::vec3 *position = nullptr;
+    size_t n = 0;
+    glm::ivec3 get_cell(const glm::vec3 &p) const;
+};
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+// Called by DipoleFMM, DipoleP3M and DipoleDirect for every ordered pair (t, s), t != s, closer than their cutoff,
+// which they leave out of the sum. May be empty. Calls for different targets run in parallel, calls for one target
+// never overlap, so accumulating into per target storage needs no synchronization.
+using NearField = std::function<void(uint32_t t, uint32_t s)>;
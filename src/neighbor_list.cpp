@@ -0,0 +1,65 @@
+#include "neighbor_list.h"
+#include <algorithm>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_scan.h>
+
+// in place exclusive scan, v[0] is expected to be 0 and v[i + 1] to hold the size of entry i
+void NeighborList::prefix_sum(std::vector<size_t> &v) {
+    tbb::parallel_scan(
+        tbb::blocked_range<size_t>(1, v.size()), size_t(0),
+        [&](const tbb::blocked_range<size_t> &range, size_t sum, bool final) {
+            for (size_t i = range.begin(); i < range.end(); i++) {
+                sum += v[i];
+                if (final) {
+                    v[i] = sum;
+                }
+            }
+            return sum;
+        },
+        [](size_t a, size_t b) { return a + b; });
+}
+
+static inline size_t varint_size(uint32_t v) {
+    size_t size = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline uint8_t *write_varint(uint8_t *p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = uint8_t(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = uint8_t(v);
+    return p;
+}
+
+static inline uint32_t zigzag(int64_t d) { return uint32_t((d << 1) ^ (d >> 63)); }
+
+void NeighborList::encode() {
+    byte_start.resize(n + 1);
+    byte_start[0] = 0;
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        uint32_t *list = index.data() + start[i];
+        const size_t count = start[i + 1] - start[i];
+        std::sort(list, list + count);
+        size_t size = 0;
+        for (size_t k = 0; k < count; k++) {
+            size += varint_size(k == 0 ? zigzag(int64_t(list[0]) - int64_t(i)) : list[k] - list[k - 1]);
+        }
+        byte_start[i + 1] = size;
+    });
+    prefix_sum(byte_start);
+    bytes.resize(byte_start[n]);
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        const uint32_t *list = index.data() + start[i];
+        const size_t count = start[i + 1] - start[i];
+        uint8_t *p = bytes.data() + byte_start[i];
+        for (size_t k = 0; k < count; k++) {
+            p = write_varint(p, k == 0 ? zigzag(int64_t(list[0]) - int64_t(i)) : list[k] - list[k - 1]);
+        }
+    });
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <tbb/parallel_for.h>
+#include <vector>
+
+// Neighbor lists of all particles in compressed sparse row form, sized exactly in two passes: every list is counted,
+// the offsets are prefix summed, then every list is written in place.
+// With `compressed` set, each list is sorted and stored as LEB128 varints: the first entry as the zigzag encoded
+// offset from the particle itself, the others as the gap to the previous entry. After a spatial sort of the particles
+// most entries take a single byte instead of four, at the cost of decoding them in every loop.
+class NeighborList {
+  public:
+    // uncompressed lists can be read this many entries past their end, for SIMD loops that mask the extra lanes
+    static constexpr size_t padding = 16;
+    bool compressed = false;
+
+    // count(i) returns the number of neighbors of particle i, fill(i, out) writes exactly that many ids to out
+    template <class Count, class Fill>
+    void build(size_t n, Count &&count, Fill &&fill) {
+        this->n = n;
+        start.resize(n + 1);
+        start[0] = 0;
+        tbb::parallel_for(size_t(0), n, [&](size_t i) { start[i + 1] = count(i); });
+        prefix_sum(start);
+        index.assign(start[n] + padding, 0);
+        tbb::parallel_for(size_t(0), n, [&](size_t i) { fill(i, index.data() + start[i]); });
+        if (compressed) {
+            encode();
+            // only the varints are kept
+            std::vector<uint32_t>().swap(index);
+        } else {
+            std::vector<size_t>().swap(byte_start);
+            std::vector<uint8_t>().swap(bytes);
+        }
+    }
+
+    size_t size() const { return n; }
+    void clear() { n = 0; }
+    size_t count(size_t i) const { return start[i + 1] - start[i]; }
+    // neighbors of particle i, only without compression
+    const uint32_t *list(size_t i) const { return index.data() + start[i]; }
+    size_t total() const { return n ? start[n] : 0; }
+    // bytes held by the lists
+    size_t memory() const {
+        return start.capacity() * sizeof(size_t) + index.capacity() * sizeof(uint32_t) +
+               byte_start.capacity() * sizeof(size_t) + bytes.capacity();
+    }
+
+    // calls f(j) for every neighbor j of particle i
+    template <class F>
+    void for_each(size_t i, F &&f) const {
+        if (!compressed) {
+            for (size_t k = start[i]; k < start[i + 1]; k++) {
+                f(index[k]);
+            }
+            return;
+        }
+        const size_t count = start[i + 1] - start[i];
+        if (count == 0) {
+            return;
+        }
+        const uint8_t *p = bytes.data() + byte_start[i];
+        uint32_t v = read_varint(p);
+        uint32_t j = uint32_t(int64_t(i) + int32_t((v >> 1) ^ (0u - (v & 1))));
+        f(j);
+        for (size_t k = 1; k < count; k++) {
+            j += read_varint(p);
+            f(j);
+        }
+    }
+
+  private:
+    size_t n = 0;
+    std::vector<size_t> start;
+    std::vector<uint32_t> index;
+    // compressed form
+    std::vector<size_t> byte_start;
+    std::vector<uint8_t> bytes;
+
+    static uint32_t read_varint(const uint8_t *&p) {
+        uint32_t v = *p & 0x7f;
+        for (int shift = 7; *p++ & 0x80; shift += 7) {
+            v |= uint32_t(*p & 0x7f) << shift;
+        }
+        return v;
+    }
+    static void prefix_sum(std::vector<size_t> &v);
+    void encode();
+};
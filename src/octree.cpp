@@ -0,0 +1,103 @@
+#include "octree.h"
+#include <algorithm>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+// spread the lower 21 bits of x so that there are two zero bits between each of them
+static inline uint64_t expand_bits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+void Octree::build(const glm::vec3 *position, size_t n) {
+    nodes.clear();
+    index.resize(n);
+    keys.resize(n);
+    if (n == 0) {
+        return;
+    }
+    glm::dvec3 lo(position[0]), hi(position[0]);
+    for (size_t i = 1; i < n; i++) {
+        lo = glm::min(lo, glm::dvec3(position[i]));
+        hi = glm::max(hi, glm::dvec3(position[i]));
+    }
+    extent = std::max(std::max(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z);
+    extent = std::max(extent * (1.0 + 1e-6), 1e-9);
+    lower = lo;
+    const double scale = double(1u << max_depth) / extent;
+    const uint64_t max_coord = (1u << max_depth) - 1;
+    std::vector<std::pair<uint64_t, uint32_t>> sorted(n);
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        glm::dvec3 p = (glm::dvec3(position[i]) - lower) * scale;
+        uint64_t x = std::min<uint64_t>(max_coord, (uint64_t)std::max(0.0, p.x));
+        uint64_t y = std::min<uint64_t>(max_coord, (uint64_t)std::max(0.0, p.y));
+        uint64_t z = std::min<uint64_t>(max_coord, (uint64_t)std::max(0.0, p.z));
+        sorted[i] = std::make_pair(expand_bits(x) << 2 | expand_bits(y) << 1 | expand_bits(z), (uint32_t)i);
+    });
+    tbb::parallel_sort(sorted.begin(), sorted.end());
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        keys[i] = sorted[i].first;
+        index[i] = sorted[i].second;
+    });
+
+    Node root;
+    root.half_size = 0.5 * extent;
+    root.center = lower + glm::dvec3(root.half_size);
+    root.begin = 0;
+    root.end = (uint32_t)n;
+    nodes.reserve(2 * n / leaf_size + 1);
+    nodes.push_back(root);
+    build_node(0, 0, position);
+}
+
+void Octree::build_node(uint32_t node, int depth, const glm::vec3 *position) {
+    if (nodes[node].size() <= leaf_size || depth == max_depth) {
+        auto &leaf = nodes[node];
+        double r2 = 0.0;
+        for (uint32_t i = leaf.begin; i < leaf.end; i++) {
+            glm::dvec3 d = glm::dvec3(position[index[i]]) - leaf.center;
+            r2 = std::max(r2, glm::dot(d, d));
+        }
+        leaf.radius = std::sqrt(r2);
+        return;
+    }
+    const int shift = 3 * (max_depth - depth - 1);
+    std::array<uint32_t, 9> bounds;
+    bounds[0] = nodes[node].begin;
+    bounds[8] = nodes[node].end;
+    for (uint64_t octant = 1; octant < 8; octant++) {
+        auto first = keys.begin() + bounds[octant - 1];
+        auto last = keys.begin() + nodes[node].end;
+        bounds[octant] = uint32_t(
+            std::partition_point(first, last, [&](uint64_t key) { return ((key >> shift) & 7) < octant; }) -
+            keys.begin());
+    }
+    const uint32_t first_child = (uint32_t)nodes.size();
+    const double half_size = 0.5 * nodes[node].half_size;
+    for (int octant = 0; octant < 8; octant++) {
+        if (bounds[octant] == bounds[octant + 1]) {
+            continue;
+        }
+        Node child;
+        child.half_size = half_size;
+        child.center = nodes[node].center + glm::dvec3(octant & 4 ? half_size : -half_size,
+                                                       octant & 2 ? half_size : -half_size,
+                                                       octant & 1 ? half_size : -half_size);
+        child.begin = bounds[octant];
+        child.end = bounds[octant + 1];
+        nodes.push_back(child);
+    }
+    nodes[node].first_child = first_child;
+    nodes[node].n_children = (uint32_t)nodes.size() - first_child;
+    double radius = 0.0;
+    for (uint32_t c = first_child; c < first_child + nodes[node].n_children; c++) {
+        build_node(c, depth + 1, position);
+        radius = std::max(radius, nodes[c].radius + glm::length(nodes[c].center - nodes[node].center));
+    }
+    nodes[node].radius = radius;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Octree over a point set, built from Morton sorted particle indices.
+// Nodes are stored in a flat array, the children of a node are contiguous and nodes[0] is the root.
+class Octree {
+  public:
+    struct Node {
+        glm::dvec3 center;       // geometric center of the cell
+        double half_size = 0.0;  // half of the cell edge length
+        double radius = 0.0;     // max distance from center to any particle in the cell
+        uint32_t begin = 0;      // particle range [begin, end) into Octree::index
+        uint32_t end = 0;
+        uint32_t first_child = 0;
+        uint32_t n_children = 0; // 0 for leaves
+        bool is_leaf() const { return n_children == 0; }
+        uint32_t size() const { return end - begin; }
+    };
+    size_t leaf_size = 32;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> index; // particle ids sorted by morton key
+    std::vector<uint64_t> keys;
+
+    void build(const glm::vec3 *position, size_t n);
+
+  private:
+    static constexpr int max_depth = 21;
+    glm::dvec3 lower;
+    double extent = 0.0;
+    void build_node(uint32_t node, int depth, const glm::vec3 *position);
+};
@@ -0,0 +1,377 @@
+#include "p3m.h"
+#include <algorithm>
+#include <cmath>
+#include <tbb/parallel_for.h>
+
+static constexpr double p3m_pi = 3.1415926535897;
+static constexpr double inv_4pi = 1.0 / (4.0 * p3m_pi);
+
+// index of the symmetric third order component (i, j, k) among the 10 distinct ones
+static inline int component(int i, int j, int k) {
+    static const int table[3][3][3] = {{{0, 1, 2}, {1, 3, 4}, {2, 4, 5}},
+                                       {{1, 3, 4}, {3, 6, 7}, {4, 7, 8}},
+                                       {{2, 4, 5}, {4, 7, 8}, {5, 8, 9}}};
+    return table[i][j][k];
+}
+// the 6 distinct components of the symmetric field gradient
+static const int gradient_components[6][2] = {{0, 0}, {0, 1}, {0, 2}, {1, 1}, {1, 2}, {2, 2}};
+
+static inline int next_pow2(int n) {
+    int p = 1;
+    while (p < n)
+        p *= 2;
+    return p;
+}
+
+// triangular shaped cloud weights of the three nearest mesh nodes along one axis
+static inline int tsc(double u, double w[3]) {
+    int i = (int)std::floor(u + 0.5);
+    double d = u - i;
+    w[0] = 0.5 * (0.5 - d) * (0.5 - d);
+    w[1] = 0.75 - d * d;
+    w[2] = 0.5 * (0.5 + d) * (0.5 + d);
+    return i - 1;
+}
+
+static void fft1d(std::complex<double> *data, int n, bool inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(data[i], data[j]);
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        double angle = 2 * p3m_pi / len * (inverse ? 1 : -1);
+        std::complex<double> wlen(std::cos(angle), std::sin(angle));
+        for (int i = 0; i < n; i += len) {
+            std::complex<double> w(1.0);
+            for (int j = 0; j < len / 2; j++) {
+                auto u = data[i + j];
+                auto v = data[i + j + len / 2] * w;
+                data[i + j] = u + v;
+                data[i + j + len / 2] = u - v;
+                w *= wlen;
+            }
+        }
+    }
+}
+
+void DipoleP3M::fft(Grid &grid, bool inverse) const {
+    const size_t strides[3] = {1, (size_t)size.x, (size_t)size.x * size.y};
+    for (int axis = 0; axis < 3; axis++) {
+        const int n = size[axis];
+        const size_t n_lines = grid.size() / n;
+        tbb::parallel_for(size_t(0), n_lines, [&](size_t line) {
+            // decompose the line index into the two coordinates orthogonal to axis
+            size_t base;
+            if (axis == 0) {
+                base = line * size.x;
+            } else if (axis == 1) {
+                base = line % size.x + (line / size.x) * strides[2];
+            } else {
+                base = line;
+            }
+            std::vector<std::complex<double>> buf(n);
+            for (int i = 0; i < n; i++)
+                buf[i] = grid[base + i * strides[axis]];
+            fft1d(buf.data(), n, inverse);
+            for (int i = 0; i < n; i++)
+                grid[base + i * strides[axis]] = buf[i];
+        });
+    }
+    if (inverse) {
+        const double scale = 1.0 / grid.size();
+        tbb::parallel_for(size_t(0), grid.size(), [&](size_t i) { grid[i] *= scale; });
+    }
+}
+
+// (1/r d/dr), (1/r d/dr)^2 and (1/r d/dr)^3 of erf(alpha r) / r, so that
+// d^2/dx_i dx_j = d1 delta_ij + d2 x_i x_j and
+// d^3/dx_i dx_j dx_k = d2 (delta_ij x_k + delta_ik x_j + delta_jk x_i) + d3 x_i x_j x_k
+void DipoleP3M::radial_terms(double r, double &d1, double &d2, double &d3) const {
+    const double c = 2.0 * alpha / std::sqrt(p3m_pi);
+    const double a2 = alpha * alpha;
+    if (alpha * r < 0.2) {
+        // Taylor series in u = r^2, the closed form cancels catastrophically here
+        const double u = r * r;
+        d1 = 2.0 * c * a2 * (-1.0 / 3.0 + a2 * u / 5.0 - a2 * a2 * u * u / 14.0 + a2 * a2 * a2 * u * u * u / 54.0);
+        d2 = 4.0 * c * a2 * a2 * (1.0 / 5.0 - a2 * u / 7.0 + a2 * a2 * u * u / 18.0 - a2 * a2 * a2 * u * u * u / 66.0);
+        d3 = 8.0 * c * a2 * a2 * a2 * (-1.0 / 7.0 + a2 * u / 9.0 - a2 * a2 * u * u / 22.0);
+        return;
+    }
+    const double E = c * std::exp(-a2 * r * r);
+    const double erf_r = std::erf(alpha * r);
+    const double r2 = r * r;
+    const double r4 = r2 * r2;
+    d1 = E / r2 - erf_r / (r2 * r);
+    d2 = -2.0 * a2 * E / r2 - 3.0 * E / r4 + 3.0 * erf_r / (r4 * r);
+    d3 = 4.0 * a2 * a2 * E / r2 + 10.0 * a2 * E / r4 + 15.0 * E / (r4 * r2) - 15.0 * erf_r / (r4 * r2 * r);
+}
+
+double DipoleP3M::split_radius() const { return std::max(cutoff, 3.5 * cell_size / splitting); }
+
+void DipoleP3M::build_kernel(Kernel &kernel, int derivative) {
+    static const int ijk[10][3] = {{0, 0, 0}, {0, 0, 1}, {0, 0, 2}, {0, 1, 1}, {0, 1, 2},
+                                   {0, 2, 2}, {1, 1, 1}, {1, 1, 2}, {1, 2, 2}, {2, 2, 2}};
+    const size_t total = (size_t)size.x * size.y * size.z;
+    kernel.components.assign(derivative == 1 ? 6 : 10, std::vector<double>(total, 0.0));
+    Grid tmp(total);
+    for (size_t c = 0; c < kernel.components.size(); c++) {
+        const int i = derivative == 1 ? gradient_components[c][0] : ijk[c][0];
+        const int j = derivative == 1 ? gradient_components[c][1] : ijk[c][1];
+        const int k = ijk[c][2];
+        tbb::parallel_for(0, size.z, [&](int z) {
+            for (int y = 0; y < size.y; y++) {
+                for (int x = 0; x < size.x; x++) {
+                    glm::ivec3 o(x, y, z);
+                    bool valid = true;
+                    for (int a = 0; a < 3; a++) {
+                        if (o[a] == size[a] / 2)
+                            valid = false;
+                        else if (o[a] > size[a] / 2)
+                            o[a] -= size[a];
+                    }
+                    double value = 0.0;
+                    glm::dvec3 r = glm::dvec3(o) * cell_size;
+                    double d1, d2, d3;
+                    radial_terms(glm::length(r), d1, d2, d3);
+                    if (valid && derivative == 1) {
+                        // the even kernel is finite at the origin, evaluate_field removes the self term
+                        value = inv_4pi * (d1 * (i == j) + d2 * r[i] * r[j]);
+                    } else if (valid && (o.x != 0 || o.y != 0 || o.z != 0)) {
+                        value = inv_4pi * (d2 * ((i == j) * r[k] + (i == k) * r[j] + (j == k) * r[i]) +
+                                           d3 * r[i] * r[j] * r[k]);
+                    }
+                    tmp[linear(x, y, z)] = value;
+                }
+            }
+        });
+        fft(tmp, false);
+        // divide by the transfer function of the TSC assignment, applied once when depositing and once when
+        // interpolating, so that the mesh reproduces the smooth kernel instead of its TSC blurred version
+        tbb::parallel_for(0, size.z, [&](int z) {
+            for (int y = 0; y < size.y; y++) {
+                for (int x = 0; x < size.x; x++) {
+                    glm::ivec3 f(x, y, z);
+                    double w = 1.0;
+                    for (int a = 0; a < 3; a++) {
+                        double half_k = p3m_pi * (f[a] <= size[a] / 2 ? f[a] : f[a] - size[a]) / size[a];
+                        double sinc = half_k == 0.0 ? 1.0 : std::sin(half_k) / half_k;
+                        w *= sinc * sinc * sinc;
+                    }
+                    size_t idx = linear(x, y, z);
+                    kernel.components[c][idx] = (derivative == 1 ? tmp[idx].real() : tmp[idx].imag()) / (w * w);
+                }
+            }
+        });
+    }
+    kernel.size = size;
+    kernel.cell_size = cell_size;
+    kernel.alpha = alpha;
+}
+
+void DipoleP3M::prepare(const glm::vec3 *position, const glm::vec3 *moment, size_t n, int derivative) {
+    alpha = splitting / cell_size;
+    glm::dvec3 lo(position[0]), hi(position[0]);
+    for (size_t i = 1; i < n; i++) {
+        lo = glm::min(lo, glm::dvec3(position[i]));
+        hi = glm::max(hi, glm::dvec3(position[i]));
+    }
+    // two spare nodes on every side for the TSC stencil, then doubled for the zero padding
+    origin = lo - glm::dvec3(2.0 * cell_size);
+    for (int a = 0; a < 3; a++) {
+        int m = (int)std::ceil((hi[a] - lo[a]) / cell_size) + 5;
+        size[a] = next_pow2(2 * m);
+    }
+    Kernel &kernel = derivative == 1 ? field_kernel : gradient_kernel;
+    if (size.x != kernel.size.x || size.y != kernel.size.y || size.z != kernel.size.z ||
+        kernel.cell_size != cell_size || kernel.alpha != alpha) {
+        build_kernel(kernel, derivative);
+    }
+    const size_t total = (size_t)size.x * size.y * size.z;
+
+    // deposit the moments, serial since neighboring particles share mesh nodes
+    for (auto &g : moment_grid)
+        g.assign(total, 0.0);
+    for (size_t s = 0; s < n; s++) {
+        glm::dvec3 u = (glm::dvec3(position[s]) - origin) / cell_size;
+        double wx[3], wy[3], wz[3];
+        int x0 = tsc(u.x, wx), y0 = tsc(u.y, wy), z0 = tsc(u.z, wz);
+        for (int dz = 0; dz < 3; dz++) {
+            for (int dy = 0; dy < 3; dy++) {
+                for (int dx = 0; dx < 3; dx++) {
+                    double w = wx[dx] * wy[dy] * wz[dz];
+                    size_t idx = linear(x0 + dx, y0 + dy, z0 + dz);
+                    for (int a = 0; a < 3; a++)
+                        moment_grid[a][idx] += w * (double)moment[s][a];
+                }
+            }
+        }
+    }
+    for (auto &g : moment_grid)
+        fft(g, false);
+    // H_i = K_ij m_j with the even kernel, dH_i/dx_j = K_ijk m_k with the odd one, whose transform is imaginary
+    output_grid.resize(derivative == 1 ? 3 : 6);
+    for (size_t c = 0; c < output_grid.size(); c++) {
+        const int i = derivative == 1 ? (int)c : gradient_components[c][0];
+        const int j = gradient_components[c][1];
+        // component(0, i, j) is also the index of the pair (i, j) among the 6 second derivatives
+        const auto &k0 = kernel.components[derivative == 1 ? component(0, i, 0) : component(i, j, 0)];
+        const auto &k1 = kernel.components[derivative == 1 ? component(0, i, 1) : component(i, j, 1)];
+        const auto &k2 = kernel.components[derivative == 1 ? component(0, i, 2) : component(i, j, 2)];
+        auto &out = output_grid[c];
+        out.resize(total);
+        const std::complex<double> factor = derivative == 1 ? 1.0 : std::complex<double>(0.0, 1.0);
+        tbb::parallel_for(size_t(0), total, [&](size_t idx) {
+            auto sum = k0[idx] * moment_grid[0][idx] + k1[idx] * moment_grid[1][idx] + k2[idx] * moment_grid[2][idx];
+            out[idx] = factor * sum;
+        });
+        fft(out, true);
+    }
+
+    const double r_split = split_radius();
+    lower = lo;
+    for (int a = 0; a < 3; a++)
+        dims[a] = std::max(1, (int)std::ceil((hi[a] - lo[a]) / r_split));
+    const size_t n_cells = (size_t)dims.x * dims.y * dims.z;
+    cell_start.assign(n_cells + 1, 0);
+    sorted.resize(n);
+    std::vector<uint32_t> particle_cell(n);
+    for (size_t s = 0; s < n; s++) {
+        glm::ivec3 c = glm::clamp(glm::ivec3((glm::dvec3(position[s]) - lower) / r_split), glm::ivec3(0), dims - 1);
+        particle_cell[s] = c.x + dims.x * (c.y + dims.y * c.z);
+        cell_start[particle_cell[s] + 1]++;
+    }
+    for (size_t c = 0; c < n_cells; c++)
+        cell_start[c + 1] += cell_start[c];
+    std::vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+    for (size_t s = 0; s < n; s++)
+        sorted[fill[particle_cell[s]]++] = (uint32_t)s;
+}
+
+template <int Components>
+std::array<double, Components> DipoleP3M::interpolate(const glm::dvec3 &r) const {
+    glm::dvec3 u = (r - origin) / cell_size;
+    double wx[3], wy[3], wz[3];
+    int x0 = tsc(u.x, wx), y0 = tsc(u.y, wy), z0 = tsc(u.z, wz);
+    std::array<double, Components> g = {};
+    for (int dz = 0; dz < 3; dz++) {
+        for (int dy = 0; dy < 3; dy++) {
+            for (int dx = 0; dx < 3; dx++) {
+                double w = wx[dx] * wy[dy] * wz[dz];
+                size_t idx = linear(x0 + dx, y0 + dy, z0 + dz);
+                for (int c = 0; c < Components; c++)
+                    g[c] += w * output_grid[c][idx].real();
+            }
+        }
+    }
+    return g;
+}
+
+template <class F>
+void DipoleP3M::for_each_pair(const glm::vec3 *position, size_t t, F &&f) const {
+    const double r_split = split_radius();
+    const double r_split2 = r_split * r_split;
+    const glm::dvec3 rt(position[t]);
+    const glm::ivec3 ct = glm::clamp(glm::ivec3((rt - lower) / r_split), glm::ivec3(0), dims - 1);
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                glm::ivec3 c = ct + glm::ivec3(dx, dy, dz);
+                if (glm::any(glm::lessThan(c, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(c, dims)))
+                    continue;
+                size_t cell = c.x + dims.x * ((size_t)c.y + dims.y * (size_t)c.z);
+                for (uint32_t i = cell_start[cell]; i < cell_start[cell + 1]; i++) {
+                    uint32_t s = sorted[i];
+                    if (s == t)
+                        continue;
+                    glm::dvec3 r = rt - glm::dvec3(position[s]);
+                    double r2 = glm::dot(r, r);
+                    if (r2 < r_split2)
+                        f(s, r, r2);
+                }
+            }
+        }
+    }
+}
+
+void DipoleP3M::evaluate(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                         Eigen::Matrix3d *grad) {
+    tbb::parallel_for(size_t(0), n, [=](size_t i) { grad[i].setZero(); });
+    if (n == 0) {
+        return;
+    }
+    prepare(position, moment, n, 2);
+    const double cutoff2 = cutoff * cutoff;
+    tbb::parallel_for(size_t(0), n, [&](size_t t) {
+        const auto g = interpolate<6>(glm::dvec3(position[t]));
+        Eigen::Matrix3d U;
+        for (int c = 0; c < 6; c++) {
+            U(gradient_components[c][0], gradient_components[c][1]) = g[c];
+            U(gradient_components[c][1], gradient_components[c][0]) = g[c];
+        }
+        // replace the smooth part by the exact interaction for every pair within r_split
+        for_each_pair(position, t, [&](uint32_t s, const glm::dvec3 &r, double r2) {
+            double d1, d2, d3;
+            radial_terms(std::sqrt(r2), d1, d2, d3);
+            if (r2 < cutoff2) {
+                if (near)
+                    near(t, s);
+                d2 = -d2;
+                d3 = -d3;
+            } else {
+                double inv_r2 = 1.0 / r2;
+                double inv_r5 = inv_r2 * inv_r2 / std::sqrt(r2);
+                d2 = 3.0 * inv_r5 - d2;
+                d3 = -15.0 * inv_r5 * inv_r2 - d3;
+            }
+            glm::dvec3 m(moment[s]);
+            double mr = glm::dot(m, r);
+            for (int a = 0; a < 3; a++) {
+                for (int b = 0; b < 3; b++) {
+                    U(a, b) += inv_4pi * (d2 * ((a == b ? mr : 0.0) + r[a] * m[b] + m[a] * r[b]) +
+                                          d3 * r[a] * r[b] * mr);
+                }
+            }
+        });
+        grad[t] = U;
+    });
+}
+
+void DipoleP3M::evaluate_field(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                               Eigen::Vector3d *field) {
+    tbb::parallel_for(size_t(0), n, [=](size_t i) { field[i].setZero(); });
+    if (n == 0) {
+        return;
+    }
+    prepare(position, moment, n, 1);
+    const double cutoff2 = cutoff * cutoff;
+    double self, self_d2, self_d3;
+    radial_terms(0.0, self, self_d2, self_d3);
+    tbb::parallel_for(size_t(0), n, [&](size_t t) {
+        const auto g = interpolate<3>(glm::dvec3(position[t]));
+        // the mesh also carries the smooth field of the target itself, K(0) m_t
+        Eigen::Vector3d H(g[0], g[1], g[2]);
+        H -= inv_4pi * self * Eigen::Vector3d(moment[t][0], moment[t][1], moment[t][2]);
+        for_each_pair(position, t, [&](uint32_t s, const glm::dvec3 &r, double r2) {
+            double d1, d2, d3;
+            radial_terms(std::sqrt(r2), d1, d2, d3);
+            if (r2 < cutoff2) {
+                if (near)
+                    near(t, s);
+                d1 = -d1;
+                d2 = -d2;
+            } else {
+                double inv_r3 = 1.0 / (r2 * std::sqrt(r2));
+                d1 = -inv_r3 - d1;
+                d2 = 3.0 * inv_r3 / r2 - d2;
+            }
+            glm::dvec3 m(moment[s]);
+            glm::dvec3 f = inv_4pi * (d1 * m + d2 * glm::dot(m, r) * r);
+            H += Eigen::Vector3d(f.x, f.y, f.z);
+        });
+        field[t] = H;
+    });
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "near_pairs.h"
+#include <Eigen/Core>
+#include <array>
+#include <complex>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Particle-particle particle-mesh (P3M) solver for the field and field gradient of a set of point dipoles.
+// The Laplace kernel is split as 1/r = erfc(alpha r)/r + erf(alpha r)/r. The smooth part is evaluated on a mesh by
+// zero padded FFT convolution (open boundaries), the rest is summed over particle pairs closer than split_radius.
+// It has the same contract as DipoleFMM: grad[t] or field[t] holds dH/dx or H from every source at least cutoff away
+// and the caller handles closer pairs through the near callback.
+class DipoleP3M {
+  public:
+    double cell_size = 0.04; // mesh spacing
+    double splitting = 0.5;  // alpha * cell_size, smaller is more accurate but widens the particle-particle range
+    double cutoff = 0.0;     // pairs closer than this are handed to the near-field callback
+
+    // grad[t] = sum of dH/dx at position[t] over all sources at least cutoff away
+    void evaluate(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                  Eigen::Matrix3d *grad);
+    // field[t] = sum of H at position[t] over all sources at least cutoff away
+    void evaluate_field(const glm::vec3 *position, const glm::vec3 *moment, size_t n, const NearField &near,
+                        Eigen::Vector3d *field);
+    double split_radius() const;
+
+  private:
+    using Grid = std::vector<std::complex<double>>;
+    // FFT of the distinct components of a derivative of erf(alpha r) / (4 pi r), divided by the TSC transfer function
+    struct Kernel {
+        std::vector<std::vector<double>> components;
+        glm::ivec3 size = glm::ivec3(0);
+        double cell_size = 0.0;
+        double alpha = 0.0;
+    };
+    glm::ivec3 size = glm::ivec3(0); // padded FFT grid size, powers of two
+    glm::dvec3 origin;
+    double alpha = 0.0;
+    // the 10 third derivatives for the gradient, kept as the imaginary part since they are odd, and the 6 second
+    // derivatives for the field, kept as the real part since they are even
+    Kernel gradient_kernel, field_kernel;
+    std::array<Grid, 3> moment_grid;
+    std::vector<Grid> output_grid; // 6 gradient or 3 field components on the mesh
+    // cell list of edge split_radius() for the particle-particle part
+    glm::dvec3 lower;
+    glm::ivec3 dims;
+    std::vector<uint32_t> cell_start, sorted;
+
+    size_t linear(int x, int y, int z) const { return x + size.x * ((size_t)y + size.y * (size_t)z); }
+    void radial_terms(double r, double &d1, double &d2, double &d3) const;
+    void build_kernel(Kernel &kernel, int derivative);
+    // mesh size, kernel, deposited and transformed moments and the cell list, derivative 1 for H and 2 for dH/dx
+    void prepare(const glm::vec3 *position, const glm::vec3 *moment, size_t n, int derivative);
+    // mesh value at r of the smooth part, interpolated from output_grid
+    template <int Components>
+    std::array<double, Components> interpolate(const glm::dvec3 &r) const;
+    // calls f(s, r, r2) for every source s != t closer than split_radius(), r = position[t] - position[s]
+    template <class F>
+    void for_each_pair(const glm::vec3 *position, size_t t, F &&f) const;
+    void fft(Grid &grid, bool inverse) const;
+};
@@ -0,0 +1,9 @@
+#pragma once
+
+// Kernels written as fixed-width loops over SoA arrays are left to the auto vectorizer. On x86-64 gcc this also emits
+// AVX-512 and AVX2 clones of the annotated function and picks one at load time based on the running CPU.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
@@ -2,8 +2,15 @@
 #include "original.h"
 #include <Eigen/Core>
 #include <Eigen/Sparse>
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_scan.h>
+#include <tbb/parallel_sort.h>
+#include <type_traits>
 
 // https://github.com/erizmr/SPH_Taichi
 static inline double W(double r, double h) {
@@ -37,99 +44,291 @@ static inline vec3 gradW(vec3 r, float h) {
     return (float)dW(length(r), h) * normalize(r);
 }
 
+// one StepPolicy instantiation per combination of the runtime flags
+template <class F>
+void Simulation::with_step_policy(F &&f) {
+    auto choose = [](bool flag, auto &&next) {
+        if (flag)
+            next(std::true_type());
+        else
+            next(std::false_type());
+    };
+    choose(enable_gravity, [&](auto gravity) {
+        choose(enable_ferro, [&](auto ferro) {
+            choose(kernel_tables_ready(), [&](auto tables) {
+                f(StepPolicy<decltype(gravity)::value, decltype(ferro)::value, decltype(tables)::value>());
+            });
+        });
+    });
+}
+
 void Simulation::init() {
-    grid_size = floor(vec3(1) / vec3(2.0 * dh));
     buffers.num_particles = num_particles;
     buffers.particle_position.reset(new vec3[num_particles]);
     buffers.particle_velocity.reset(new vec3[num_particles]);
     buffers.density.reset(new float[num_particles]);
     buffers.drhodt.reset(new float[num_particles]);
     buffers.dvdt.reset(new vec3[num_particles]);
-    buffers.grid.reset(new Cell[grid_size.x * grid_size.y * grid_size.z]);
-    buffers.neighbors.reset(new Neighbors[num_particles]);
+    buffers.cell_particles.reset(new uint32_t[num_particles]);
+    buffers.particle_cell.reset(new uint32_t[num_particles]);
+    buffers.particle_id.reset(new uint32_t[num_particles]);
     buffers.P.reset(new float[num_particles]);
     buffers.particle_H.reset(new vec3[num_particles]);
     buffers.particle_M.reset(new vec3[num_particles]);
     buffers.particle_mag_moment.reset(new vec3[num_particles]);
     buffers.particle_mag_force.reset(new vec3[num_particles]);
+    buffers.mag_force_position.reset(new vec3[num_particles]);
+    buffers.next_mag_force.reset(new vec3[num_particles]);
     buffers.Hext.reset(new vec3[num_particles]);
+    buffers.Hext_grad.reset(new mat3[num_particles]);
+    buffers.neighbor_position.reset(new vec3[num_particles]);
     pointers.particle_position = buffers.particle_position.get();
     pointers.particle_velocity = buffers.particle_velocity.get();
     pointers.density = buffers.density.get();
     pointers.drhodt = buffers.drhodt.get();
     pointers.dvdt = buffers.dvdt.get();
-    pointers.grid = buffers.grid.get();
-    pointers.neighbors = buffers.neighbors.get();
+    pointers.cell_particles = buffers.cell_particles.get();
+    pointers.particle_cell = buffers.particle_cell.get();
+    pointers.particle_id = buffers.particle_id.get();
     pointers.P = buffers.P.get();
     pointers.particle_H = buffers.particle_H.get();
     pointers.particle_M = buffers.particle_M.get();
     pointers.particle_mag_moment = buffers.particle_mag_moment.get();
     pointers.Hext = buffers.Hext.get();
+    pointers.Hext_grad = buffers.Hext_grad.get();
     pointers.particle_mag_force = buffers.particle_mag_force.get();
+    pointers.mag_force_position = buffers.mag_force_position.get();
+    pointers.next_mag_force = buffers.next_mag_force.get();
+    pointers.neighbor_position = buffers.neighbor_position.get();
+    resize_grid();
+    update_kernel_tables();
+    mag_pointers = pointers;
+    external_field.clear();
+    external_field.add_magnet(ExternalField::point_dipole(dvec3(0, 1e5, 0)), dvec3(0.5, -0.6, 0.5));
+    external_field.lower = lower;
+    external_field.upper = upper;
     mass = radius * radius * radius * rho0;
     tbb::parallel_for((size_t)0, num_particles, [=](size_t i) {
+        pointers.particle_id[i] = (uint32_t)i;
         pointers.density[i] = rho0;
         pointers.particle_velocity[i] = vec3(0);
+        pointers.dvdt[i] = vec3(0);
         pointers.P[i] = P(i);
     });
 }
+// cells are at least as large as the neighbor search radius
+void Simulation::resize_grid() {
+    ivec3 size = glm::max(ivec3(floor(vec3(1) / vec3(2.0f * dh + neighbor_skin))), ivec3(1));
+    if (size == grid_size && buffers.cell_start)
+        return;
+    grid_size = size;
+    const size_t n_cells = (size_t)grid_size.x * grid_size.y * grid_size.z;
+    buffers.cell_start.reset(new uint32_t[n_cells + 1]);
+    buffers.cell_fill.reset(new std::atomic<uint32_t>[n_cells]);
+    pointers.cell_start = buffers.cell_start.get();
+    pointers.cell_fill = buffers.cell_fill.get();
+}
+// parallel counting sort: count per cell, exclusive prefix sum into cell_start, scatter, then sort each cell so
+// the order does not depend on the scheduling of the scatter
 void Simulation::build_grid() {
-    tbb::parallel_for(0, grid_size.x * grid_size.y * grid_size.z, [=](int i) { pointers.grid[i].n_particles = 0; });
+    if (sparse_grid) {
+        hashed_grid.cell_size = 2.0f * dh + neighbor_skin;
+        hashed_grid.build(pointers.particle_position, num_particles, pointers.particle_cell);
+        return;
+    }
+    resize_grid();
+    const size_t n_cells = (size_t)grid_size.x * grid_size.y * grid_size.z;
+    tbb::parallel_for(size_t(0), n_cells, [=](size_t c) { pointers.cell_fill[c] = 0; });
     tbb::parallel_for((size_t)0, num_particles, [=](size_t i) {
-        vec3 p = pointers.particle_position[i];
-        auto gid = get_grid_index(p);
-        auto cnt = pointers.grid[gid].n_particles.fetch_add(1);
-        if (cnt <= Cell::max_particles) {
-            pointers.grid[gid].particles[cnt] = (int)i;
-        }
+        auto gid = get_grid_index(pointers.particle_position[i]);
+        pointers.particle_cell[i] = gid;
+        pointers.cell_fill[gid].fetch_add(1, std::memory_order_relaxed);
+    });
+    tbb::parallel_scan(
+        tbb::blocked_range<size_t>(0, n_cells), uint32_t(0),
+        [=](const tbb::blocked_range<size_t> &range, uint32_t sum, bool final) {
+            for (size_t c = range.begin(); c < range.end(); c++) {
+                uint32_t count = pointers.cell_fill[c].load(std::memory_order_relaxed);
+                if (final) {
+                    pointers.cell_start[c] = sum;
+                }
+                sum += count;
+            }
+            return sum;
+        },
+        [](uint32_t a, uint32_t b) { return a + b; });
+    pointers.cell_start[n_cells] = (uint32_t)num_particles;
+    tbb::parallel_for(size_t(0), n_cells, [=](size_t c) { pointers.cell_fill[c] = pointers.cell_start[c]; });
+    tbb::parallel_for((size_t)0, num_particles, [=](size_t i) {
+        auto slot = pointers.cell_fill[pointers.particle_cell[i]].fetch_add(1, std::memory_order_relaxed);
+        pointers.cell_particles[slot] = (uint32_t)i;
+    });
+    tbb::parallel_for(size_t(0), n_cells, [=](size_t c) {
+        auto *cell = pointers.cell_particles;
+        std::sort(cell + pointers.cell_start[c], cell + pointers.cell_start[c + 1]);
     });
 }
-void Simulation::find_neighbors() {
-    tbb::parallel_for((size_t)0, num_particles, [=](size_t id) {
-        vec3 p = pointers.particle_position[id];
-        auto &neighbors = pointers.neighbors[id];
-        neighbors.n_neighbors = 0;
-        auto cell_idx = get_cell(p);
-        for (int dx = -1; dx <= 1; dx++) {
+template <class F>
+void Simulation::for_each_cell_range(const vec3 &p, F &&f) const {
+    if (sparse_grid) {
+        const ivec3 c = hashed_grid.cell(p);
+        for (int dz = -1; dz <= 1; dz++) {
             for (int dy = -1; dy <= 1; dy++) {
-                for (int dz = -1; dz <= 1; dz++) {
-                    auto candidate_cell_idx = cell_idx + ivec3(dx, dy, dz);
-                    if (glm::all(glm::greaterThanEqual(candidate_cell_idx, ivec3(0))) &&
-                        glm::all(glm::lessThan(candidate_cell_idx, grid_size))) {
-                        auto &cell = pointers.grid[get_index_i(candidate_cell_idx)];
-                        for (size_t i = 0; i < cell.n_particles; i++) {
-                            auto j = cell.particles[i];
-                            if (i == j)
-                                continue;
-                            auto q = pointers.particle_position[j];
-                            if (length(p - q) < 2.0 * dh) {
-                                if (neighbors.n_neighbors < Neighbors::max_neighbors) {
-                                    neighbors.neighbors[neighbors.n_neighbors++] = j;
-                                }
-                            }
-                        }
-                    }
+                for (int dx = -1; dx <= 1; dx++) {
+                    auto range = hashed_grid.range(c + ivec3(dx, dy, dz));
+                    if (range.first != range.second)
+                        f(hashed_grid.particles(), range.first, range.second);
                 }
             }
         }
+        return;
+    }
+    auto cell_idx = get_cell(p);
+    const int x0 = std::max(cell_idx.x - 1, 0), x1 = std::min(cell_idx.x + 1, grid_size.x - 1);
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            const int y = cell_idx.y + dy, z = cell_idx.z + dz;
+            if (y < 0 || z < 0 || y >= grid_size.y || z >= grid_size.z)
+                continue;
+            // cells adjacent along x are contiguous in cell_particles
+            f(pointers.cell_particles, pointers.cell_start[get_index_i(ivec3(x0, y, z))],
+              pointers.cell_start[get_index_i(ivec3(x1, y, z)) + 1]);
+        }
+    }
+}
+void Simulation::find_neighbors() {
+    auto scan = [=](size_t id, auto &&f) {
+        vec3 p = pointers.particle_position[id];
+        const float radius = 2.0f * dh + neighbor_skin;
+        for_each_cell_range(p, [&](const uint32_t *particles, uint32_t begin, uint32_t end) {
+            for (uint32_t k = begin; k < end; k++) {
+                auto j = particles[k];
+                if (j == id)
+                    continue;
+                auto q = pointers.particle_position[j];
+                if (length(p - q) < radius) {
+                    f(j);
+                }
+            }
+        });
+    };
+    neighbors.build(
+        num_particles,
+        [&](size_t id) {
+            size_t n = 0;
+            scan(id, [&](uint32_t) { n++; });
+            return n;
+        },
+        [&](size_t id, uint32_t *out) { scan(id, [&](uint32_t j) { *out++ = j; }); });
+}
+void Simulation::update_neighbors() {
+    // the lists cover 2 dh + skin, they stay complete until two particles closed the skin between them
+    // symmetric_pairs walks the grid cells directly and needs no lists, but the implicit pressure solve and the block
+    // time steps do
+    const bool need_lists = !symmetric_pairs || pressure_solver == PressureSolver::Implicit || block_timesteps;
+    const bool lists_ready = !need_lists || neighbors.size() == num_particles;
+    if (neighbor_skin > 0.0f && neighbor_lists_valid && lists_ready &&
+        max_displacement(pointers.neighbor_position) <= 0.5f * neighbor_skin)
+        return;
+    build_grid();
+    if (need_lists)
+        find_neighbors();
+    else
+        neighbors.clear();
+    tbb::parallel_for(size_t(0), num_particles,
+                      [=](size_t id) { pointers.neighbor_position[id] = pointers.particle_position[id]; });
+    neighbor_lists_valid = true;
+}
+// spreads the low 21 bits of v so that there are two zero bits between each of them
+static inline uint64_t spread_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+template <typename T>
+static void permute(T *data, const std::vector<uint32_t> &order) {
+    std::vector<T> old(data, data + order.size());
+    tbb::parallel_for(size_t(0), order.size(), [&](size_t i) { data[i] = old[order[i]]; });
+}
+bool Simulation::reorder_due() {
+    if (reorder_interval <= 0 && reorder_degradation <= 0.0f)
+        return false;
+    if (steps_since_reorder < 0 || (reorder_interval > 0 && steps_since_reorder >= reorder_interval))
+        return true;
+    if (reorder_degradation <= 0.0f)
+        return false;
+    // particle_cell is from the last build_grid
+    size_t runs = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(1, num_particles), size_t(1),
+        [=](const tbb::blocked_range<size_t> &r, size_t n) {
+            for (size_t i = r.begin(); i < r.end(); i++) {
+                n += pointers.particle_cell[i] != pointers.particle_cell[i - 1];
+            }
+            return n;
+        },
+        [](size_t a, size_t b) { return a + b; });
+    return runs > reorder_degradation * sorted_cell_runs;
+}
+void Simulation::reorder_particles() {
+    // the background magnetic force job reads and writes per-particle buffers
+    if (magnetic_job)
+        magnetic_job->group.wait();
+    std::vector<std::pair<uint64_t, uint32_t>> keys(num_particles);
+    tbb::parallel_for(size_t(0), num_particles, [&](size_t i) {
+        const vec3 p = pointers.particle_position[i];
+        ivec3 c = sparse_grid ? hashed_grid.cell(p) + ivec3(1 << 20) : get_cell(p);
+        keys[i] = {spread_bits(c.x) | spread_bits(c.y) << 1 | spread_bits(c.z) << 2, (uint32_t)i};
     });
+    tbb::parallel_sort(keys.begin(), keys.end());
+    std::vector<uint32_t> order(num_particles);
+    tbb::parallel_for(size_t(0), num_particles, [&](size_t i) { order[i] = keys[i].second; });
+    sorted_cell_runs = num_particles > 0;
+    for (size_t i = 1; i < num_particles; i++) {
+        sorted_cell_runs += keys[i].first != keys[i - 1].first;
+    }
+    permute(pointers.particle_position, order);
+    permute(pointers.particle_velocity, order);
+    permute(pointers.particle_H, order);
+    permute(pointers.particle_M, order);
+    permute(pointers.particle_mag_moment, order);
+    permute(pointers.particle_mag_force, order);
+    permute(pointers.mag_force_position, order);
+    permute(pointers.next_mag_force, order);
+    permute(pointers.Hext, order);
+    permute(pointers.Hext_grad, order);
+    permute(pointers.density, order);
+    permute(pointers.dvdt, order);
+    permute(pointers.drhodt, order);
+    permute(pointers.P, order);
+    permute(pointers.particle_id, order);
+    if (magnetization_guess.size() == 3 * (Eigen::Index)num_particles) {
+        Eigen::VectorXd old = magnetization_guess;
+        tbb::parallel_for(size_t(0), num_particles,
+                          [&](size_t i) { magnetization_guess.segment<3>(3 * i) = old.segment<3>(3 * order[i]); });
+    }
+    if (block.mag_accel.size() == num_particles)
+        permute(block.mag_accel.data(), order);
+    steps_since_reorder = 0;
+    neighbor_lists_valid = false;
 }
 vec3 Simulation::dvdt_momentum_term(size_t id) {
     const vec3 gravity(0.0, -0.98, 0.0);
     CHECK(mass != 0.0);
     vec3 dvdt(0.0);
     auto ra = pointers.particle_position[id];
-    auto &neighbors = pointers.neighbors[id];
     auto Pa = pointers.P[id];
     auto rho_a = pointers.density[id];
-    for (size_t i = 0; i < neighbors.n_neighbors; i++) {
-        auto b = neighbors.neighbors[i];
+    for_each_neighbor(id, [&](uint32_t b) {
         auto rb = pointers.particle_position[b];
         auto Pb = pointers.P[b];
         auto rho_b = pointers.density[b];
         CHECK(rho_a != 0.0);
         dvdt += -mass * (Pa / (rho_a * rho_a) + Pb / (rho_b * rho_b)) * gradW(ra - rb, dh);
-    }
+    });
     if (enable_gravity)
         dvdt += gravity;
     CHECK(!glm::any(glm::isnan(dvdt)));
@@ -140,9 +339,7 @@ vec3 Simulation::dvdt_viscosity_term(size_t id) {
     vec3 dvdt(0.0);
     auto ra = pointers.particle_position[id];
     auto va = pointers.particle_velocity[id];
-    auto &neighbors = pointers.neighbors[id];
-    for (size_t i = 0; i < neighbors.n_neighbors; i++) {
-        auto b = neighbors.neighbors[i];
+    for_each_neighbor(id, [&](uint32_t b) {
         auto rb = pointers.particle_position[b];
         auto vb = pointers.particle_velocity[b];
         auto vab = va - vb;
@@ -152,7 +349,7 @@ vec3 Simulation::dvdt_viscosity_term(size_t id) {
             auto pi_ab = -v * dot(vab, rab) / (dot(rab, rab) + eps * dh * dh);
             dvdt += mass * pi_ab * gradW(rab, dh); // minus?
         }
-    }
+    });
     CHECK(!glm::any(glm::isnan(dvdt)));
     return dvdt;
 }
@@ -161,10 +358,8 @@ vec3 Simulation::dvdt_tension_term(size_t id) {
     vec3 f(0.0);
     auto ra = pointers.particle_position[id];
     auto va = pointers.particle_velocity[id];
-    auto &neighbors = pointers.neighbors[id];
     const auto k = 1.0f;
-    for (size_t i = 0; i < neighbors.n_neighbors; i++) {
-        auto b = neighbors.neighbors[i];
+    for_each_neighbor(id, [&](uint32_t b) {
         auto rb = pointers.particle_position[b];
         auto vb = pointers.particle_velocity[b];
         auto vab = va - vb;
@@ -172,7 +367,7 @@ vec3 Simulation::dvdt_tension_term(size_t id) {
         if (length(rab) <= k * h) {
             f += tension * mass * mass * float(std::cos(3 * pi / (2 * k * h) * length(rab))) * rab;
         }
-    }
+    });
     CHECK(!glm::any(glm::isnan(f)));
     return f / mass;
 }
@@ -188,51 +383,289 @@ float Simulation::drhodt(size_t id) {
     float drhodt = 0.0;
     auto ra = pointers.particle_position[id];
     auto va = pointers.particle_velocity[id];
-    auto &neighbors = pointers.neighbors[id];
-    for (size_t i = 0; i < neighbors.n_neighbors; i++) {
-        auto b = neighbors.neighbors[i];
+    for_each_neighbor(id, [&](uint32_t b) {
         auto rb = pointers.particle_position[b];
         auto vb = pointers.particle_velocity[b];
         auto vab = va - vb;
         auto rab = ra - rb;
         drhodt += mass * dot(vab, gradW(rab, dh));
-    }
+    });
     CHECK(!std::isnan(drhodt));
     return drhodt;
 }
-void Simulation::naive_collison_handling() {
-    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
-        auto &p = pointers.particle_position[id];
-        auto &v = pointers.particle_velocity[id];
-        auto k = 0.3;
-        for (int i = 0; i < 3; i++) {
-            if (p[i] < lower[i]) {
-                p[i] = lower[i];
-                if (v[i] < 0.0) {
-                    v[i] += -(1 + k) * v[i];
+// dvdt_full and drhodt in one neighbor sweep: rab, |rab| and dW are computed once per pair and the particle's own
+// state is loaded once. Each term keeps its own sum so the result matches the separate functions.
+template <class Policy, bool Force, bool Density>
+void Simulation::fused_terms(size_t id, vec3 &dvdt, float &drhodt, float rewind) {
+    constexpr float eps = 0.01f;
+    const float k = 1.0f;
+    const vec3 ra = pointers.particle_position[id];
+    const vec3 va = pointers.particle_velocity[id];
+    const float Pa = pointers.P[id];
+    const float rho_a = pointers.density[id];
+    if constexpr (Policy::checks)
+        CHECK(rho_a != 0.0);
+    constexpr bool tables = Policy::tables;
+    vec3 momentum(0.0), viscosity(0.0), tension_force(0.0);
+    float density_rate = 0.0f;
+    for_each_neighbor(id, [&](uint32_t b) {
+        const vec3 vab = va - pointers.particle_velocity[b];
+        vec3 rab = ra - pointers.particle_position[b];
+        if (rewind != 0.0f)
+            rab -= rewind * vab;
+        const float r2 = dot(rab, rab);
+        if (r2 == 0.0f)
+            return;
+        // with the tables no sqrt is needed, r is only computed for the analytic kernels
+        const float r = tables ? 0.0f : std::sqrt(r2);
+        const vec3 grad = tables ? kernel_tables.dW_r(r2) * rab : (float)dW(r, dh) * (rab / r);
+        if constexpr (Force) {
+            const float rho_b = pointers.density[b];
+            momentum += -mass * (Pa / (rho_a * rho_a) + pointers.P[b] / (rho_b * rho_b)) * grad;
+            if (dot(vab, rab) < 0.0) {
+                auto v = -2 * alpha * dh * c0 / (rho_a + rho_b);
+                auto pi_ab = -v * dot(vab, rab) / (r2 + eps * dh * dh);
+                viscosity += mass * pi_ab * grad;
+            }
+            if constexpr (tables) {
+                tension_force += tension * mass * mass * kernel_tables.tension_cos(r2) * rab;
+            } else if (r <= k * h) {
+                tension_force += tension * mass * mass * float(std::cos(3 * pi / (2 * k * h) * r)) * rab;
+            }
+        }
+        if constexpr (Density) {
+            density_rate += mass * dot(vab, grad);
+        }
+    });
+    if constexpr (Force) {
+        const vec3 gravity(0.0, -0.98, 0.0);
+        if constexpr (Policy::gravity)
+            momentum += gravity;
+        dvdt = momentum + viscosity + tension_force / mass;
+        if constexpr (Policy::checks)
+            CHECK(!glm::any(glm::isnan(dvdt)));
+    }
+    if constexpr (Density) {
+        drhodt = density_rate;
+        if constexpr (Policy::checks)
+            CHECK(!std::isnan(drhodt));
+    }
+}
+// the 13 cells of the half stencil: every neighbor cell that comes after the home cell in z, y, x order
+static const ivec3 half_stencil[13] = {
+    {1, 0, 0},   {-1, 1, 0}, {0, 1, 0},  {1, 1, 0}, {-1, -1, 1}, {0, -1, 1}, {1, -1, 1},
+    {-1, 0, 1},  {0, 0, 1},  {1, 0, 1},  {-1, 1, 1}, {0, 1, 1},  {1, 1, 1}};
+template <class F>
+void Simulation::for_each_pair(F &&f, float rewind) {
+    const float r2max = 4.0f * dh * dh;
+    const uint32_t *particles = sparse_grid ? hashed_grid.particles() : pointers.cell_particles;
+    auto cell_range = [&](const ivec3 &c) -> std::pair<uint32_t, uint32_t> {
+        if (sparse_grid)
+            return hashed_grid.range(c);
+        if (glm::any(glm::lessThan(c, ivec3(0))) || glm::any(glm::greaterThanEqual(c, grid_size)))
+            return {0, 0};
+        const uint32_t i = get_index_i(c);
+        return {pointers.cell_start[i], pointers.cell_start[i + 1]};
+    };
+    auto visit = [&](uint32_t a, uint32_t b) {
+        vec3 rab = pointers.particle_position[a] - pointers.particle_position[b];
+        if (rewind != 0.0f)
+            rab -= rewind * (pointers.particle_velocity[a] - pointers.particle_velocity[b]);
+        if (dot(rab, rab) < r2max)
+            f(a, b, rab);
+    };
+    // a cell and its half stencil only touch cells within one step of it, so cells three apart along some axis can
+    // be processed concurrently: 27 colours by (x, y, z) mod 3
+    std::vector<ivec3> cells[27];
+    auto add_cell = [&](const ivec3 &c) { cells[c.x % 3 + 3 * (c.y % 3) + 9 * (c.z % 3)].push_back(c); };
+    if (sparse_grid) {
+        for (size_t i = 0; i < hashed_grid.n_cells(); i++) {
+            // shifted by a multiple of 3 so that the coordinates are non negative
+            add_cell(hashed_grid.cell_coord(i) + ivec3(3 << 20));
+        }
+    } else {
+        for (int z = 0; z < grid_size.z; z++) {
+            for (int y = 0; y < grid_size.y; y++) {
+                for (int x = 0; x < grid_size.x; x++) {
+                    const uint32_t i = get_index_i(ivec3(x, y, z));
+                    if (pointers.cell_start[i] != pointers.cell_start[i + 1])
+                        add_cell(ivec3(x, y, z));
                 }
             }
-            if (p[i] > upper[i]) {
-                p[i] = upper[i];
-                if (v[i] > 0.0) {
-                    v[i] += -(1 + k) * v[i];
+        }
+    }
+    const ivec3 shift = sparse_grid ? ivec3(3 << 20) : ivec3(0);
+    for (auto &colour : cells) {
+        tbb::parallel_for(size_t(0), colour.size(), [&](size_t k) {
+            const ivec3 c = colour[k] - shift;
+            const auto home = cell_range(c);
+            for (uint32_t i = home.first; i < home.second; i++) {
+                for (uint32_t j = i + 1; j < home.second; j++) {
+                    visit(particles[i], particles[j]);
+                }
+            }
+            for (const auto &offset : half_stencil) {
+                const auto other = cell_range(c + offset);
+                for (uint32_t i = home.first; i < home.second; i++) {
+                    for (uint32_t j = other.first; j < other.second; j++) {
+                        visit(particles[i], particles[j]);
+                    }
                 }
             }
+        });
+    }
+}
+template <class Policy>
+void Simulation::pair_dvdt() {
+    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) { pointers.dvdt[id] = vec3(0.0f); });
+    add_pair_dvdt<Policy>();
+    const vec3 gravity(0.0, -0.98, 0.0);
+    if constexpr (Policy::gravity) {
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) { pointers.dvdt[id] += gravity; });
+    }
+}
+template <class Policy>
+void Simulation::add_pair_dvdt() {
+    constexpr float eps = 0.01f;
+    const float k = 1.0f;
+    // momentum, viscosity and tension are all antisymmetric in a and b
+    constexpr bool tables = Policy::tables;
+    for_each_pair([=](uint32_t a, uint32_t b, const vec3 &rab) {
+        const float r2 = dot(rab, rab);
+        const vec3 grad = tables ? kernel_tables.dW_r(r2) * rab : gradW(rab, dh);
+        const float rho_a = pointers.density[a], rho_b = pointers.density[b];
+        vec3 f = -mass * (pointers.P[a] / (rho_a * rho_a) + pointers.P[b] / (rho_b * rho_b)) * grad;
+        const vec3 vab = pointers.particle_velocity[a] - pointers.particle_velocity[b];
+        if (dot(vab, rab) < 0.0) {
+            auto v = -2 * alpha * dh * c0 / (rho_a + rho_b);
+            auto pi_ab = -v * dot(vab, rab) / (r2 + eps * dh * dh);
+            f += mass * pi_ab * grad;
+        }
+        if constexpr (tables) {
+            f += tension * mass * kernel_tables.tension_cos(r2) * rab;
+        } else if (length(rab) <= k * h) {
+            f += tension * mass * float(std::cos(3 * pi / (2 * k * h) * length(rab))) * rab;
         }
+        pointers.dvdt[a] += f;
+        pointers.dvdt[b] -= f;
+    });
+}
+template <class Policy>
+void Simulation::pair_drhodt() {
+    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) { pointers.drhodt[id] = 0.0f; });
+    add_pair_drhodt<Policy>();
+}
+template <class Policy>
+void Simulation::add_pair_drhodt(float rewind) {
+    constexpr bool tables = Policy::tables;
+    // symmetric in a and b
+    for_each_pair(
+        [=](uint32_t a, uint32_t b, const vec3 &rab) {
+            const vec3 vab = pointers.particle_velocity[a] - pointers.particle_velocity[b];
+            const vec3 grad = tables ? kernel_tables.dW_r(dot(rab, rab)) * rab : gradW(rab, dh);
+            const float d = mass * dot(vab, grad);
+            pointers.drhodt[a] += d;
+            pointers.drhodt[b] += d;
+        },
+        rewind);
+}
+// particle_mag_force / mass, zero without ferro or while the force is NaN
+template <class Policy>
+vec3 Simulation::mag_acceleration(size_t id) const {
+    if constexpr (Policy::ferro) {
+        const vec3 f = pointers.particle_mag_force[id];
+        if (!glm::any(glm::isnan(f)))
+            return f / mass;
+    }
+    return vec3(0.0f);
+}
+template <class Policy>
+void Simulation::compute_dvdt() {
+    if (symmetric_pairs) {
+        pair_dvdt<Policy>();
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            pointers.dvdt[id] += mag_acceleration<Policy>(id);
+            if constexpr (Policy::checks)
+                CHECK(!glm::any(glm::isnan(pointers.dvdt[id])));
+        });
+        return;
+    }
+    if (use_simd_sph()) {
+        const vec3 gravity = Policy::gravity ? vec3(0.0, -0.98, 0.0) : vec3(0.0);
+        const auto constants = sph_constants();
+        sph_simd.load(pointers.particle_position, pointers.particle_velocity, pointers.P, pointers.density,
+                      num_particles);
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            vec3 dvdt = sph_simd.dvdt(constants, id, neighbors.list(id), neighbors.count(id)) + gravity;
+            pointers.dvdt[id] = dvdt + mag_acceleration<Policy>(id);
+        });
+        return;
+    }
+    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+        vec3 dvdt;
+        float unused;
+        fused_terms<Policy, true, false>(id, dvdt, unused);
+        pointers.dvdt[id] = dvdt + mag_acceleration<Policy>(id);
+    });
+}
+void Simulation::compute_dvdt() {
+    with_step_policy([&](auto policy) { compute_dvdt<decltype(policy)>(); });
+}
+// the positions of the last neighbor build were resolved at the end of an earlier step
+void Simulation::naive_collison_handling() {
+    collider.prepare();
+    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+        collide(pointers.particle_position[id], pointers.particle_velocity[id], pointers.neighbor_position[id]);
     });
 }
+void Simulation::collide(vec3 &p, vec3 &v, const vec3 &previous) const {
+    auto k = 0.3;
+    for (int i = 0; i < 3; i++) {
+        if (p[i] < lower[i]) {
+            p[i] = lower[i];
+            if (v[i] < 0.0) {
+                v[i] += -(1 + k) * v[i];
+            }
+        }
+        if (p[i] > upper[i]) {
+            p[i] = upper[i];
+            if (v[i] > 0.0) {
+                v[i] += -(1 + k) * v[i];
+            }
+        }
+    }
+    if (!collider.empty())
+        collider.collide(p, v, k, previous);
+}
 float Simulation::P(size_t id) {
     auto B = rho0 * c0 * c0 / gamma;
     return B * (std::pow(pointers.density[id] / rho0, gamma) - 1.0);
 }
 void Simulation::run_step_euler() {
-    build_grid();
-    find_neighbors();
-    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
-        vec3 dvdt = dvdt_full(id);
-        pointers.drhodt[id] = drhodt(id);
-        pointers.dvdt[id] = dvdt;
-    });
+    update_kernel_tables();
+    with_step_policy([&](auto policy) { euler_step<decltype(policy)>(); });
+    sim_time += dt;
+}
+template <class Policy>
+void Simulation::euler_step() {
+    update_neighbors();
+    if (symmetric_pairs) {
+        pair_dvdt<Policy>();
+        pair_drhodt<Policy>();
+    } else if (use_simd_sph()) {
+        const vec3 gravity = Policy::gravity ? vec3(0.0, -0.98, 0.0) : vec3(0.0);
+        const auto constants = sph_constants();
+        sph_simd.load(pointers.particle_position, pointers.particle_velocity, pointers.P, pointers.density,
+                      num_particles);
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            pointers.dvdt[id] = sph_simd.dvdt(constants, id, neighbors.list(id), neighbors.count(id)) + gravity;
+            pointers.drhodt[id] = sph_simd.drhodt(constants, id, neighbors.list(id), neighbors.count(id));
+        });
+    } else {
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            fused_terms<Policy, true, true>(id, pointers.dvdt[id], pointers.drhodt[id]);
+        });
+    }
     tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
         pointers.particle_position[id] += dt * 0.5f * pointers.particle_velocity[id];
         pointers.particle_velocity[id] += dt * 0.5f * pointers.dvdt[id];
@@ -269,10 +702,13 @@ Eigen::Matrix3d Simulation::H_mat(vec3 r, vec3 m) {
     return mat;
 }
 vec3 Simulation::H(vec3 r, vec3 m) {
-    float r_norm = length(r);
-    if (r_norm == 0.0) {
+    const float r2 = dot(r, r);
+    if (r2 == 0.0f) {
         return vec3(0);
     }
+    if (kernel_tables_ready() && r2 < kernel_tables.H_r.range2()) {
+        return kernel_tables.H_r(r2) * dot(r, m) * r - (kernel_tables.W_avr(r2) / 3.0f) * m;
+    }
     vec3 r_hat = normalize(r);
     vec3 H_r = dot(r_hat, m) * (W_avr(r) - W(r)) * r_hat - (W_avr(r) / 3.0f) * m;
     CHECK(!glm::any(glm::isnan(H_r)));
@@ -280,10 +716,14 @@ vec3 Simulation::H(vec3 r, vec3 m) {
 }
 
 float Simulation::W_avr(vec3 r) {
-    float r_norm = length(r);
-    if (r_norm == 0.0) {
+    const float r2 = dot(r, r);
+    if (r2 == 0.0f) {
         return 0.0;
     }
+    if (kernel_tables_ready() && r2 < kernel_tables.W_avr.range2()) {
+        return kernel_tables.W_avr(r2);
+    }
+    float r_norm = std::sqrt(r2);
     float W_r_h = 0.0;
     float q = r_norm / h;
     auto q2 = q * q;
@@ -305,6 +745,9 @@ float Simulation::W_avr(vec3 r) {
 }
 
 float Simulation::W(vec3 r) {
+    if (kernel_tables_ready()) {
+        return kernel_tables.W(dot(r, r));
+    }
     float r_norm = length(r);
     float W_r_h = 0.0;
     float q = r_norm / h;
@@ -340,250 +783,65 @@ float Simulation::dWdr(vec3 r) {
     dW_r_h *= (1.0 / (h * h * h));
     return dW_r_h;
 }
-mat3 Simulation::dHext(dvec3 r) {
-    if (dot(r, r) == 0.0) {
-        return mat3(0.0);
-    }
-    auto m1 = m[0];
-    auto m2 = m[1];
-    auto m3 = m[2];
-    auto r1 = r[0];
-    auto r2 = r[1];
-    auto r3 = r[2];
-    glm::dmat3 T;
-    T[0][0] = -((m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                 m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                 m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * -3.0 +
-                r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r1 * fabs(r1) * ((r1 / fabs(r1))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r1) * ((r1 / fabs(r1))) *
-                  (m1 - r1 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[0][1] = -(r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r1 * fabs(r2) * ((r2 / fabs(r2))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r2) * ((r2 / fabs(r2))) *
-                  (m1 - r1 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[0][2] = -(r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r1 * fabs(r3) * ((r3 / fabs(r3))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r3) * ((r3 / fabs(r3))) *
-                  (m1 - r1 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[1][0] = -(r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r2 * fabs(r1) * ((r1 / fabs(r1))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r1) * ((r1 / fabs(r1))) *
-                  (m2 - r2 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[1][1] = -((m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                 m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                 m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * -3.0 +
-                r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r2 * fabs(r2) * ((r2 / fabs(r2))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r2) * ((r2 / fabs(r2))) *
-                  (m2 - r2 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[1][2] = -(r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r2 * fabs(r3) * ((r3 / fabs(r3))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r3) * ((r3 / fabs(r3))) *
-                  (m2 - r2 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[2][0] = -(r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r1) * ((r1 / fabs(r1))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r3 * fabs(r1) * ((r1 / fabs(r1))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r1) * ((r1 / fabs(r1))) *
-                  (m3 - r3 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[2][1] = -(r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r2) * ((r2 / fabs(r2))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r3 * fabs(r2) * ((r2 / fabs(r2))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r2) * ((r2 / fabs(r2))) *
-                  (m3 - r3 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T[2][2] = -((m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                 m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                 m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * -3.0 +
-                r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) *
-                    (-m3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m1 * r1 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m2 * r2 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-                     m3 * r3 * fabs(r3) * ((r3 / fabs(r3))) * 1.0 /
-                         pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0)) *
-                    3.0 +
-                r3 * fabs(r3) * ((r3 / fabs(r3))) *
-                    (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                     m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                    1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 3.0 / 2.0) +
-              fabs(r3) * ((r3 / fabs(r3))) *
-                  (m3 - r3 *
-                            (m1 * r1 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m2 * r2 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) +
-                             m3 * r3 * 1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0))) *
-                            1.0 / sqrt(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0)) * 3.0) *
-                  1.0 / pow(pow(fabs(r1), 2.0) + pow(fabs(r2), 2.0) + pow(fabs(r3), 2.0), 5.0 / 2.0) * 3.0;
-    T *= 1.0 / (4 * pi);
-    return T;
-}
-dvec3 Simulation::Hext(dvec3 r) {
-
-    auto r_hat = normalize(r);
-    auto H = 1 / (4 * pi) * ((3.0 * r_hat * dot(m, r_hat) - m) / (std::pow(length(r), 3)));
-    return H;
+// the analytic kernels as functions of r for the tables. Near r = 0, where W_avr - W cancels in float and the limits
+// are 0 / 0, the value at a small r is used; H_r is scaled by r^2 and dW / r by the zero vector there.
+static vec3 along_x(double r) { return vec3(float(r), 0.0f, 0.0f); }
+static double tension_cos(double r, double h) {
+    const double k = 1.0;
+    return r <= k * h ? std::cos(3 * pi / (2 * k * h) * r) : 0.0;
+}
+static double H_radial(Simulation &sim, double r) {
+    r = std::max(r, 0.05 * sim.h);
+    return (sim.W_avr(along_x(r)) - sim.W(along_x(r))) / (r * r);
+}
+void Simulation::build_kernel_tables() {
+    kernel_tables.ready = false;
+    kernel_tables.h = h;
+    kernel_tables.dh = dh;
+    kernel_tables.dW_r.build(2.0f * dh, [&](double r) {
+        r = std::max(r, 1e-4 * dh);
+        return dW(r, dh) / r;
+    });
+    kernel_tables.tension_cos.build(2.0f * dh, [&](double r) { return tension_cos(r, h); });
+    kernel_tables.W.build(2.0f * h, [&](double r) { return W(along_x(r)); });
+    kernel_tables.W_avr.build(2.0f * h, [&](double r) { return W_avr(along_x(std::max(r, 1e-4 * h))); });
+    kernel_tables.H_r.build(2.0f * h, [&](double r) { return H_radial(*this, r); });
+    kernel_tables.ready = true;
+}
+void Simulation::update_kernel_tables() {
+    if (use_kernel_tables && (!kernel_tables.ready || kernel_tables.h != h || kernel_tables.dh != dh)) {
+        // a pending magnetic force job reads the tables, they are only rebuilt once it is joined
+        finish_magnetic_force(true);
+        build_kernel_tables();
+        CHECK(check_kernel_tables() < 1e-3);
+    }
+}
+double Simulation::check_kernel_tables() {
+    // compares against the analytic kernels, so the tables must not be in use while they are evaluated. dW_r and H_r
+    // are compared as dW and W_avr - W, the way they enter the sums.
+    finish_magnetic_force(true);
+    const bool ready = kernel_tables.ready;
+    kernel_tables.ready = false;
+    const double errors[] = {
+        kernel_tables.dW_r.max_error([&](double r) { return dW(r, dh) / r; }, 1),
+        kernel_tables.tension_cos.max_error([&](double r) { return tension_cos(r, h); }),
+        kernel_tables.W.max_error([&](double r) { return W(along_x(r)); }),
+        kernel_tables.W_avr.max_error([&](double r) { return W_avr(along_x(r)); }),
+        kernel_tables.H_r.max_error([&](double r) { return H_radial(*this, r); }, 2),
+    };
+    kernel_tables.ready = ready;
+    return *std::max_element(std::begin(errors), std::end(errors));
 }
 void Simulation::eval_Hext() {
     // still need some thinking here
     // single point magnetic field
     // lets try with (0, 1, 0)
     // for (size_t i = 0; i < num_particles; i++) {
-    //     pointers.Hext[i] = vec3(1, 0, 0);
+    //     mag_pointers.Hext[i] = vec3(1, 0, 0);
     // }
     // const double mu0 = 1.25663706212e-16;
 
-    for (size_t i = 0; i < num_particles; i++) {
-        dvec3 p = pointers.particle_position[i];
-        dvec3 r = p - dipole;
-        pointers.Hext[i] = Hext(r);
-    }
+    external_field.evaluate(mag_pointers.particle_position, num_particles, mag_pointers.Hext, mag_pointers.Hext_grad);
 }
 
 void Simulation::visualize_field(Eigen::MatrixXd &P, Eigen::MatrixXi &F) {
@@ -602,30 +860,29 @@ void Simulation::visualize_field(Eigen::MatrixXd &P, Eigen::MatrixXi &F) {
     //         }
     //     }
     // }
-    std::vector<std::pair<vec3, vec3>> segments;
+    // trace field lines both ways from a 10x10 grid of seeds, all lines advance together in one field evaluation
+    constexpr int n_seeds = 100, n_segments = 20, n_substeps = 10;
+    std::vector<vec3> q(2 * n_seeds), field(2 * n_seeds);
     for (int x = 0; x < 10; x++) {
         for (int z = 0; z < 10; z++) {
             vec3 p(x, 0.0, z);
             p /= 10.0f;
-            auto q = p;
-            auto q0 = q;
-            for (int i = 0; i < 20; i++) {
-                for (int j = 0; j < 10; j++) {
-                    q += normalize(Hext(dvec3(q) - dipole)) * 0.005;
-                }
-                segments.emplace_back(q0, q);
-                q0 = q;
-            }
-            q0 = p;
-            q = p;
-            for (int i = 0; i < 20; i++) {
-                for (int j = 0; j < 10; j++) {
-                    q += -normalize(Hext(dvec3(q) - dipole)) * 0.005;
-                }
-                segments.emplace_back(q0, q);
-                q0 = q;
+            q[2 * (x * 10 + z)] = p;
+            q[2 * (x * 10 + z) + 1] = p;
+        }
+    }
+    std::vector<std::pair<vec3, vec3>> segments(2 * n_seeds * n_segments);
+    for (int i = 0; i < n_segments; i++) {
+        auto q0 = q;
+        for (int j = 0; j < n_substeps; j++) {
+            external_field.evaluate(q.data(), q.size(), field.data(), nullptr);
+            for (size_t k = 0; k < q.size(); k++) {
+                q[k] += (k % 2 == 0 ? 1.0f : -1.0f) * normalize(field[k]) * 0.005f;
             }
         }
+        for (size_t k = 0; k < q.size(); k++) {
+            segments[k * n_segments + i] = {q0[k], q[k]};
+        }
     }
     P.resize(segments.size() * 2, 3);
     F.resize(segments.size(), 2);
@@ -637,77 +894,6 @@ void Simulation::visualize_field(Eigen::MatrixXd &P, Eigen::MatrixXi &F) {
     }
 }
 
-void Simulation::get_R(Eigen::Matrix3d &R, const Eigen::Vector3d &rt, const Eigen::Vector3d &rs) {
-    // given rt and rs world coordinate, transform it to the coordinate where rs is on origin
-    // let (xi, eta, zeta) be the unit vectors and assume rt is on its zeta axis.
-    Eigen::Vector3d zeta = (rt - rs).normalized();
-    Eigen::Vector3d z;
-    if (abs(zeta.x()) < 1e-2) {
-        z << 0, 0, 1;
-    } else {
-        z << 1, 0, 0;
-    }
-    Eigen::Vector3d eta = zeta.cross(z);
-    eta.normalize();
-    Eigen::Vector3d xi = eta.cross(zeta);
-    R.col(0) = xi;
-    R.col(1) = eta;
-    R.col(2) = zeta;
-}
-
-// data provided in appendix
-float Simulation::get_C1(float q) {
-    float C1 = 0.0;
-    if (0 < q && q <= 1) {
-        C1 = q * (q * (q * (q * (9.97813616438174e-09) + (-2.97897856524718e-08)) + (2.38918644566813e-09)) +
-                  (4.53199938857366e-08)) +
-             (2.44617454752747e-11);
-    } else if (1 < q && q <= 2) {
-        C1 = q * (q * (q * (q * (-2.76473728643294e-09) + (2.86975546540539e-08)) + (-9.94582836806651e-08)) +
-                  (1.25129924573675e-07)) +
-             (-2.37010166723652e-08);
-    } else if (2 < q && q <= 3) {
-        C1 = q * (q * (q * (q * (-1.09679990621465e-09) + (9.77055663264614e-09)) + (-2.54781238661150e-08)) +
-                  (2.65020634884934e-09)) +
-             (5.00787562417835e-08);
-    } else if (3 < q && q <= 4) {
-        C1 = q * (q * (q * (q * (3.79927162333632e-10) + (-6.26368404962679e-09)) + (3.94760528277489e-08)) +
-                  (-1.13580541622200e-07)) +
-             (1.27491333574323e-07);
-    }
-    return C1;
-}
-
-float Simulation::get_C2(float q) {
-    float C2 = 0.0;
-    if (0 < q && q <= 1) {
-        C2 = q * (q * (q * (q * (6.69550479838731e-08) + (-1.61753307173877e-07)) + (1.68213714992711e-08)) +
-                  (1.34558143036838e-07)) +
-             (1.10976027980100e-10);
-    } else if (1 < q && q <= 2) {
-        C2 = q * (q * (q * (q * (-3.08460139955194e-08) + (2.29192245602275e-07)) + (-5.88399621128587e-07)) +
-                  (5.61170054591844e-07)) +
-             (-1.14421132829680e-07);
-    } else if (2 < q && q <= 3) {
-        C2 = q * (q * (q * (q * (3.50477408060213e-09) + (-5.25956271895141e-08)) + (2.78876509535747e-07)) +
-                  (-6.24199554212217e-07)) +
-             (4.91807818904985e-07);
-    } else if (3 < q && q <= 4) {
-        C2 = q * (q * (q * (q * (7.33485346367840e-10) + (-9.58855788627803e-09)) + (4.37085309763591e-08)) +
-                  (-7.48004594092261e-08)) +
-             (2.34161209605651e-08);
-    }
-    return C2;
-}
-
-void Simulation::get_T_hat(Eigen::Matrix3d &T_hat, const Eigen::Vector3d &m_hat_s, float q) {
-    float C1 = get_C1(q);
-    float C2 = get_C2(q);
-    T_hat << m_hat_s[2] * C1, 0, m_hat_s[0] * C1, 0, m_hat_s[2] * C1, m_hat_s[1] * C1, m_hat_s[0] * C1, m_hat_s[1] * C1,
-        m_hat_s[2] * C2;
-    T_hat /= h * h * h * h;
-}
-
 void Simulation::get_Force_Tensor(Eigen::Matrix3d &Ts, const Eigen::Vector3d &rt, const Eigen::Vector3d &rs,
                                   const Eigen::Vector3d &ms) {
     Eigen::Vector3d r = rt - rs;
@@ -725,163 +911,233 @@ void Simulation::get_Force_Tensor(Eigen::Matrix3d &Ts, const Eigen::Vector3d &rt
     // Ts *= mu0;
 }
 
+void Simulation::interparticle_force_tensor_direct(Eigen::Matrix3d *U) {
+    // beyond 4h get_Force_Tensor is the point dipole field gradient, pairs inside 4h are added by near_field
+    direct.cutoff = 4.0 * h;
+    direct.evaluate(mag_pointers.particle_position, mag_pointers.particle_mag_moment, num_particles, NearField(), U);
+    tbb::parallel_for<size_t>(0, num_particles, [&](size_t t) { U[t] *= mu0; });
+}
+
+void Simulation::interparticle_force_tensor_barnes_hut(Eigen::Matrix3d *U) {
+    barnes_hut.theta = bh_theta;
+    barnes_hut.cutoff = 4.0 * h;
+    barnes_hut.build(mag_pointers.particle_position, mag_pointers.particle_mag_moment, num_particles);
+    tbb::parallel_for<size_t>(0, num_particles, [&](size_t t) {
+        Eigen::Matrix3d Ts;
+        Eigen::Vector3d rt;
+        rt << mag_pointers.particle_position[t][0], mag_pointers.particle_position[t][1],
+            mag_pointers.particle_position[t][2];
+        auto far = [&](const dvec3 &position, const dvec3 &moment) {
+            Eigen::Vector3d rs(position[0], position[1], position[2]), ms(moment[0], moment[1], moment[2]);
+            get_Force_Tensor(Ts, rt, rs, ms);
+            U[t] += Ts * mu0;
+        };
+        auto near = [&](uint32_t s) {
+            Eigen::Vector3d rs, ms;
+            rs << mag_pointers.particle_position[s][0], mag_pointers.particle_position[s][1],
+                mag_pointers.particle_position[s][2];
+            ms << mag_pointers.particle_mag_moment[s][0], mag_pointers.particle_mag_moment[s][1],
+                mag_pointers.particle_mag_moment[s][2];
+            if ((rt - rs).norm() < 4.0 * h)
+                return; // handled by near_field
+            get_Force_Tensor(Ts, rt, rs, ms);
+            U[t] += Ts * mu0;
+        };
+        barnes_hut.for_each_source(dvec3(rt[0], rt[1], rt[2]), far, near);
+    });
+}
+
+void Simulation::interparticle_force_tensor_fmm(Eigen::Matrix3d *U) {
+    // beyond 2h W_avr is exactly the point dipole term, so get_Force_Tensor reduces to the dipole field gradient
+    // the fmm sums for every pair beyond 4h; pairs inside 4h are added by near_field
+    fmm.order = fmm_order;
+    fmm.theta = fmm_theta;
+    fmm.cutoff = 4.0 * h;
+    fmm.evaluate(mag_pointers.particle_position, mag_pointers.particle_mag_moment, num_particles, NearField(), U);
+    tbb::parallel_for<size_t>(0, num_particles, [&](size_t t) { U[t] *= mu0; });
+}
+
+void Simulation::interparticle_force_tensor_p3m(Eigen::Matrix3d *U) {
+    // same split as the fmm: the mesh and its particle-particle correction cover every pair beyond 4h
+    p3m.cell_size = p3m_cell_size;
+    p3m.splitting = p3m_splitting;
+    p3m.cutoff = 4.0 * h;
+    p3m.evaluate(mag_pointers.particle_position, mag_pointers.particle_mag_moment, num_particles, NearField(), U);
+    tbb::parallel_for<size_t>(0, num_particles, [&](size_t t) { U[t] *= mu0; });
+}
+
 void Simulation::compute_m(const Eigen::VectorXd &b) {
     Eigen::VectorXd Gamma_b = Gamma * b;
     for (size_t i = 0; i < num_particles; i++) {
-        pointers.particle_mag_moment[i] =
+        mag_pointers.particle_mag_moment[i] =
             vec3(Gamma_b.segment<3>(i * 3)[0], Gamma_b.segment<3>(i * 3)[1], Gamma_b.segment<3>(i * 3)[2]);
     }
 }
-void Simulation::magnetization() {
+void Simulation::apply_magnetization_operator(const Eigen::VectorXd &x, Eigen::VectorXd &y) {
+    // y = (I - G Gamma) x, where (G m)_t = sum_s H(r_t - r_s, m_s) + W(r_t - r_s) m_s is the smoothed field plus the
+    // smoothed magnetization
+    std::vector<vec3> moment(num_particles);
+    tbb::parallel_for<size_t>(0, num_particles, [&](size_t s) {
+        moment[s] = vec3(Gamma * x[3 * s], Gamma * x[3 * s + 1], Gamma * x[3 * s + 2]);
+    });
+    std::vector<Eigen::Vector3d> field(num_particles);
+    // beyond 2h W vanishes and W_avr is the point dipole term, so the far field is the plain dipole sum
+    std::vector<vec3> near_field(num_particles, vec3(0.0f));
+    NearField near = [&](uint32_t t, uint32_t s) {
+        vec3 r = mag_pointers.particle_position[t] - mag_pointers.particle_position[s];
+        near_field[t] += H(r, moment[s]) + W(r) * moment[s];
+    };
+    if (magnetic_solver == MagneticSolver::Direct) {
+        direct.cutoff = 2.0 * h;
+        direct.evaluate_field(mag_pointers.particle_position, moment.data(), num_particles, near, field.data());
+    } else if (magnetic_solver == MagneticSolver::BarnesHut) {
+        // H is the point dipole field beyond 2h, so it serves for the accepted cells as well
+        barnes_hut.theta = bh_theta;
+        barnes_hut.cutoff = 2.0 * h;
+        barnes_hut.build(mag_pointers.particle_position, moment.data(), num_particles);
+        tbb::parallel_for<size_t>(0, num_particles, [&](size_t t) {
+            const vec3 rt = mag_pointers.particle_position[t];
+            vec3 f(0.0f);
+            auto far = [&](const dvec3 &position, const dvec3 &m) { f += H(rt - vec3(position), vec3(m)); };
+            auto sources = [&](uint32_t s) {
+                const vec3 r = rt - mag_pointers.particle_position[s];
+                if (s == t)
+                    return;
+                if (dot(r, r) < 4.0f * h * h)
+                    near(uint32_t(t), s);
+                else
+                    f += H(r, moment[s]);
+            };
+            barnes_hut.for_each_source(dvec3(rt), far, sources);
+            field[t] = Eigen::Vector3d(f[0], f[1], f[2]);
+        });
+    } else if (magnetic_solver == MagneticSolver::P3M) {
+        p3m.cell_size = p3m_cell_size;
+        p3m.splitting = p3m_splitting;
+        p3m.cutoff = 2.0 * h;
+        p3m.evaluate_field(mag_pointers.particle_position, moment.data(), num_particles, near, field.data());
+    } else {
+        fmm.order = fmm_order;
+        fmm.theta = fmm_theta;
+        fmm.cutoff = 2.0 * h;
+        fmm.evaluate_field(mag_pointers.particle_position, moment.data(), num_particles, near, field.data());
+    }
     tbb::parallel_for<size_t>(0, num_particles, [&](size_t t) {
-        pointers.particle_H[t] = vec3(0.0f, 0.0f, 0.0f);
-        pointers.particle_M[t] = vec3(0.0f, 0.0f, 0.0f);
-        for (size_t s = 0; s < num_particles; s++) {
-            if (t == s)
-                continue;
-            pointers.particle_H[t] +=
-                H(pointers.particle_position[t] - pointers.particle_position[s], pointers.particle_mag_moment[s]);
-            pointers.particle_M[t] +=
-                pointers.particle_mag_moment[s] * W(pointers.particle_position[t] - pointers.particle_position[s]);
-        }
+        vec3 f = near_field[t] + W(vec3(0.0f)) * moment[t];
+        field[t] += Eigen::Vector3d(f[0], f[1], f[2]);
     });
+    y.resize(x.size());
+    tbb::parallel_for<size_t>(0, num_particles,
+                              [&](size_t t) { y.segment<3>(3 * t) = x.segment<3>(3 * t) - field[t]; });
+}
+
+void Simulation::solve_magnetization(const Eigen::VectorXd &hext, Eigen::VectorXd &b) {
+    // matrix free BiCGSTAB on (I - G Gamma) b = hext, warm started from the previous solution since the particles
+    // barely move between two refreshes. Unpreconditioned: H(0) vanishes, so the diagonal block of every particle is
+    // the same (1 - Gamma W(0)) I and block Jacobi would only rescale the system.
+    const double hext_norm = hext.norm();
+    if (hext_norm == 0.0) {
+        // the operator is non singular, without an external field the particles stay unmagnetized
+        b.setZero(hext.size());
+        magnetization_guess = b;
+        return;
+    }
+    if (magnetization_guess.size() == hext.size()) {
+        b = magnetization_guess;
+    } else {
+        b = hext;
+    }
+    const double tolerance = magnetization_tolerance * hext_norm;
+    Eigen::VectorXd r, r_hat, p, v, s, t;
+    apply_magnetization_operator(b, r);
+    r = hext - r;
+    r_hat = r;
+    p.setZero(r.size());
+    v.setZero(r.size());
+    double rho = 1.0, alpha = 1.0, omega = 1.0;
+    int iter = 0;
+    double residual = r.norm();
+    while (residual > tolerance && iter < magnetization_max_iterations) {
+        iter++;
+        double rho_new = r_hat.dot(r);
+        if (rho_new == 0.0) {
+            break;
+        }
+        double beta = (rho_new / rho) * (alpha / omega);
+        rho = rho_new;
+        p = r + beta * (p - omega * v);
+        apply_magnetization_operator(p, v);
+        alpha = rho / r_hat.dot(v);
+        b += alpha * p;
+        s = r - alpha * v;
+        residual = s.norm();
+        if (residual <= tolerance) {
+            break;
+        }
+        apply_magnetization_operator(s, t);
+        omega = t.dot(s) / t.dot(t);
+        b += omega * s;
+        r = s - omega * t;
+        residual = r.norm();
+    }
+    printf("magnetization solve: %d iterations, residual %e\n", iter, residual / hext_norm);
+    magnetization_guess = b;
 }
 
 void Simulation::compute_magenetic_force() {
     eval_Hext();
     Eigen::VectorXd hext(3 * num_particles), b;
     for (size_t i = 0; i < num_particles; i++) {
-        hext.segment<3>(3 * i) << pointers.Hext[i][0], pointers.Hext[i][1], pointers.Hext[i][2];
+        hext.segment<3>(3 * i) << mag_pointers.Hext[i][0], mag_pointers.Hext[i][1], mag_pointers.Hext[i][2];
     }
     if (enable_interparticle_magnetization) {
-        // magnetization();
-        Eigen::SparseMatrix<double> G;
-        G.resize(3 * num_particles, 3 * num_particles);
-        Eigen::MatrixXd G_tmp;
-        G_tmp.resize(3 * num_particles, 3);
-        G_tmp.setZero();
-        // G.setZero();
-        std::vector<Eigen::Triplet<double>> trip;
-#if 0
-    for (size_t i = 0; i < num_particles; i++) {
-        vec3 ri = pointers.particle_position[i];
-        for (size_t j = 0; j < num_particles; j++) {
-            vec3 rj = pointers.particle_position[j];
-            // rj -= vec3(dipole);
-            vec3 r = ri - rj;
-            vec3 mj = pointers.particle_mag_moment[j];
-            //   trip.push_back(Eigen::Triplet<double>(3 * j, 3 * j,
-            // pointers.particle_position[j][0])); trip.push_back(Eigen::Triplet<double>(3 * j + 1, 3 * j + 1,
-            // pointers.particle_position[j][1])); trip.push_back(Eigen::Triplet<double>(3 * j + 2, 3 * j + 2,
-            // pointers.particle_position[j][2])); for (int k = 0; k < 3; k++) {
-            //     trip.emplace_back(3 * k, 3 * k, r[k]);
-            // }
-            // for (int k = 0; k < 3; k++) {
-            //     trip.emplace_back(3 * j + k, 3 * j + k, pointers.particle_H[j][k] + pointers.particle_M[j][k]);
-            // }
-            Eigen::Matrix3d Hi = H_mat(r, mj);
-            Eigen::Matrix3d Wi = Eigen::Matrix3d::Identity() * W(r);
-            // std::cout << Hi << std::endl;
-            for (int a = 0; a < 3; a++) {
-                for (int b = 0; b < 3; b++) {
-                    trip.emplace_back(3 * j + a, 3 * j + b, Hi(a, b) + Wi(a, b));
-                }
-            }
-        }
-    }
-#else
-        tbb::parallel_for<size_t>(0, num_particles, [&](size_t j) {
-            vec3 rj = pointers.particle_position[j];
-            vec3 mj = pointers.particle_mag_moment[j];
-            Eigen::Matrix3d tmp;
-            tmp.setZero();
-            for (size_t i = 0; i < num_particles; i++) {
-                vec3 ri = pointers.particle_position[i];
-                vec3 r = ri - rj;
-                Eigen::Matrix3d Hi = H_mat(r, mj);
-                Eigen::Matrix3d Wi = Eigen::Matrix3d::Identity() * W(r);
-                tmp += Hi + Wi;
-            }
-            G_tmp.block<3, 3>(3 * j, 0) = tmp;
-        });
-        for (size_t j = 0; j < num_particles; j++) {
-            for (int a = 0; a < 3; a++) {
-                for (int b = 0; b < 3; b++) {
-                    trip.emplace_back(3 * j + a, 3 * j + b, G_tmp(3 * j + a, b));
-                }
-            }
-        }
-#endif
-        G.setFromTriplets(trip.begin(), trip.end());
-        Eigen::SparseMatrix<double> ident;
-        ident.resize(3 * num_particles, 3 * num_particles);
-        ident.setIdentity();
-        Eigen::SparseMatrix<double> A = G * Gamma - ident;
-        Eigen::LeastSquaresConjugateGradient<Eigen::SparseMatrix<double>> cg;
-        cg.compute(A);
-
-        b = cg.solve(-1.0 * hext);
-        printf("%lf\n", b.norm());
+        solve_magnetization(hext, b);
         compute_m(b);
-        // b = cg.solve(-1.0 * hext);
     } else {
         b = hext;
         compute_m(b);
     }
     // std::cout << b << std::endl;
+    std::vector<Eigen::Matrix3d> U(num_particles, Eigen::Matrix3d::Zero());
+    if (enable_interparticle_force) {
+        switch (magnetic_solver) {
+        case MagneticSolver::Direct:
+            interparticle_force_tensor_direct(U.data());
+            break;
+        case MagneticSolver::BarnesHut:
+            interparticle_force_tensor_barnes_hut(U.data());
+            break;
+        case MagneticSolver::FMM:
+            interparticle_force_tensor_fmm(U.data());
+            break;
+        case MagneticSolver::P3M:
+            interparticle_force_tensor_p3m(U.data());
+            break;
+        }
+        // pairs inside 4h use the C1/C2 tensor for every solver
+        near_field.h = h;
+        near_field.build(mag_pointers.particle_position, mag_pointers.particle_mag_moment, num_particles);
+        near_field.evaluate(U.data());
+    }
     // for (size_t t = 0; t < num_particles; t++) {
     tbb::parallel_for<size_t>(0, num_particles, [&](size_t t) {
 #if 1
-        Eigen::Vector3d m_hat, ft;
-        Eigen::Matrix3d R, Ts, T_hat;
-
-        float q;
-        double dist;
-        Eigen::Matrix3d U;
-        U.setZero();
-        Eigen::Vector3d rt, mt;
-        rt << pointers.particle_position[t][0], pointers.particle_position[t][1], pointers.particle_position[t][2];
-        mt << pointers.particle_mag_moment[t][0], pointers.particle_mag_moment[t][1],
-            pointers.particle_mag_moment[t][2];
-        if (enable_interparticle_force) {
-            for (size_t s = 0; s < num_particles; s++) {
-                Ts.setZero();
-                Eigen::Vector3d rs, ms;
-                rs << pointers.particle_position[s][0], pointers.particle_position[s][1],
-                    pointers.particle_position[s][2];
-                ms << pointers.particle_mag_moment[s][0], pointers.particle_mag_moment[s][1],
-                    pointers.particle_mag_moment[s][2];
-                dist = (rt - rs).norm();
-                if (dist < 4.0 * h) {
-                    q = dist / h;
-                    get_R(R, rt, rs); // note rs is the source!
-                    m_hat = R.transpose() * ms;
-                    get_T_hat(T_hat, m_hat, q);
-                    Ts = R * T_hat * R.transpose(); // * 10000000.0;
-                    // std::cout << Ts << std::endl;
-                } else {
-                    get_Force_Tensor(Ts, rt, rs, ms);
-                    // Ts *= 0.1;
-                    Ts *= mu0;
-                }
-                U += Ts;
-            }
-            ft = U * mt;
-        } else {
-            ft.setZero();
-        }
+        Eigen::Vector3d mt;
+        mt << mag_pointers.particle_mag_moment[t][0], mag_pointers.particle_mag_moment[t][1],
+            mag_pointers.particle_mag_moment[t][2];
+        Eigen::Vector3d ft = U[t] * mt;
         dvec3 F = dvec3(ft[0], ft[1], ft[2]);
-        F += glm::dmat3(dHext(dvec3(pointers.particle_position[t]) - dipole)) * dvec3(mt[0], mt[1], mt[2]) * mu0;
-        pointers.particle_mag_force[t] = vec3(F);
+        F += glm::dmat3(mag_pointers.Hext_grad[t]) * dvec3(mt[0], mt[1], mt[2]) * mu0;
+        mag_pointers.particle_mag_force[t] = vec3(F);
 #else
         mat3 U(0.0);
-        auto rt = pointers.particle_position[t];
-        auto mt = pointers.particle_mag_moment[t];
+        auto rt = mag_pointers.particle_position[t];
+        auto mt = mag_pointers.particle_mag_moment[t];
         for (size_t s = 0; s < num_particles; s++) {
             if (s == t)
                 continue;
-            auto rs = pointers.particle_position[s];
-            auto ms = pointers.particle_mag_moment[s];
+            auto rs = mag_pointers.particle_position[s];
+            auto ms = mag_pointers.particle_mag_moment[s];
             float r = glm::length(rt - rs);
             float q = r * (1 / h);
             vec3 r_vec = rt - rs;
@@ -895,63 +1151,530 @@ void Simulation::compute_magenetic_force() {
             U += Bij;
         }
         auto ft = U * mt;
-        ft += glm::dmat3(dHext(dvec3(pointers.particle_position[t]) - dipole)) * dvec3(mt[0], mt[1], mt[2]) * mu0;
+        ft += glm::dmat3(mag_pointers.Hext_grad[t]) * dvec3(mt[0], mt[1], mt[2]) * mu0;
         // ft += mu0 * mt 
-        pointers.particle_mag_force[t] = ft;
+        mag_pointers.particle_mag_force[t] = ft;
 // printf("%f\n", length(ft));
 #endif
     });
 }
 
-void Simulation::run_step_adami() {
-    if (n_iter == 0) {
-        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) { pointers.particle_mag_force[id] = vec3(0); });
-        if (enable_ferro)
-            compute_magenetic_force();
+float Simulation::max_displacement(const vec3 *since) {
+    return tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, num_particles), 0.0f,
+        [=](const tbb::blocked_range<size_t> &r, float d) {
+            for (size_t id = r.begin(); id < r.end(); id++) {
+                d = std::max(d, length(pointers.particle_position[id] - since[id]));
+            }
+            return d;
+        },
+        [](float a, float b) { return std::max(a, b); });
+}
+
+bool Simulation::magnetic_refresh_due() {
+    switch (magnetic_refresh) {
+    case MagneticRefresh::Fixed:
+        return steps_since_magnetic_refresh >= magnetic_refresh_interval;
+    case MagneticRefresh::Adaptive:
+        return steps_since_magnetic_refresh >= magnetic_refresh_max_interval ||
+               max_mag_force_displacement() > magnetic_refresh_displacement * h;
     }
-    build_grid();
-    find_neighbors();
-    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
-        vec3 dvdt = dvdt_full(id);
-        vec3 f = pointers.particle_mag_force[id];
-        if (!glm::any(glm::isnan(f)))
-            pointers.dvdt[id] = dvdt + f / mass; // v(t + dt/2)
+    return true;
+}
+
+void Simulation::refresh_magnetic_force() {
+    mag_pointers = pointers;
+    if (enable_ferro)
+        compute_magenetic_force();
+    tbb::parallel_for(size_t(0), num_particles,
+                      [=](size_t id) { pointers.mag_force_position[id] = pointers.particle_position[id]; });
+    steps_since_magnetic_refresh = 0;
+}
+
+void Simulation::launch_magnetic_force() {
+    if (!magnetic_job)
+        magnetic_job.reset(new MagneticJob);
+    tbb::parallel_for(size_t(0), num_particles,
+                      [=](size_t id) { pointers.mag_force_position[id] = pointers.particle_position[id]; });
+    steps_since_magnetic_refresh = 0;
+    if (!enable_ferro)
+        return;
+    // the job reads the position snapshot and writes moments, Hext and the back force buffer, SPH touches none of them
+    mag_pointers = pointers;
+    mag_pointers.particle_position = pointers.mag_force_position;
+    mag_pointers.particle_mag_force = pointers.next_mag_force;
+    magnetic_job->done = false;
+    magnetic_job->pending = true;
+    magnetic_job->group.run([this] {
+        compute_magenetic_force();
+        magnetic_job->done = true;
     });
-    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+}
+
+void Simulation::finish_magnetic_force(bool wait) {
+    if (!magnetic_job || !magnetic_job->pending || (!wait && !magnetic_job->done))
+        return;
+    magnetic_job->group.wait();
+    magnetic_job->pending = false;
+    std::swap(buffers.particle_mag_force, buffers.next_mag_force);
+    pointers.particle_mag_force = buffers.particle_mag_force.get();
+    pointers.next_mag_force = buffers.next_mag_force.get();
+}
+
+// CFL on c0 and the fastest particle, the force criterion on the largest acceleration as of the last compute_dvdt and
+// the viscous limit, all maxima in one parallel reduction
+float Simulation::sph_substep(const char **limit) {
+    const vec2 max2 = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, num_particles), vec2(0.0f),
+        [=](const tbb::blocked_range<size_t> &r, vec2 m) {
+            for (size_t id = r.begin(); id < r.end(); id++) {
+                const vec3 v = pointers.particle_velocity[id], a = pointers.dvdt[id];
+                m.x = std::max(m.x, dot(v, v));
+                m.y = std::max(m.y, dot(a, a));
+            }
+            return m;
+        },
+        [](vec2 a, vec2 b) { return vec2(std::max(a.x, b.x), std::max(a.y, b.y)); });
+    // the implicit solver keeps density without sound waves, only the flow speed limits the step
+    const float sound = pressure_solver == PressureSolver::Tait ? c0 : 0.0f;
+    const float cfl = sph_cfl * dh / (sound + std::sqrt(max2.x));
+    const float force = max2.y > 0.0f ? sph_force_cfl * std::sqrt(dh / std::sqrt(max2.y)) : cfl;
+    const float nu = alpha * dh * c0 / 10.0f;
+    const float viscous = nu > 0.0f ? sph_viscous_cfl * dh * dh / nu : cfl;
+    const float step = std::min({cfl, force, viscous});
+    if (limit)
+        *limit = step == cfl ? "cfl" : step == force ? "force" : "viscous";
+    return step;
+}
+
+// magnetic force bookkeeping, reordering and neighbor lists at the start of every step
+void Simulation::begin_step() {
+    collider.prepare();
+    if (steps_since_magnetic_refresh < 0) {
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) { pointers.particle_mag_force[id] = vec3(0); });
+        refresh_magnetic_force();
+    }
+    if (async_magnetic_force)
+        finish_magnetic_force(false);
+    steps_since_magnetic_refresh++;
+    if (reorder_due())
+        reorder_particles();
+    steps_since_reorder++;
+    update_neighbors();
+}
+void Simulation::refresh_magnetic_force_if_due() {
+    if (!magnetic_refresh_due())
+        return;
+    if (enable_ferro) {
+        printf("compute magnetic force; iter=%zu\n", n_iter);
+    } else {
+        printf("iter=%zu\n", n_iter);
+    }
+    if (async_magnetic_force) {
+        finish_magnetic_force(true);
+        launch_magnetic_force();
+    } else {
+        refresh_magnetic_force();
+    }
+}
+void Simulation::run_step_adami(float dt) {
+    update_kernel_tables();
+    with_step_policy([&](auto policy) { adami_step<decltype(policy)>(dt); });
+    sim_time += dt;
+}
+// Kick-drift-kick in as few sweeps over the particles as the dependencies allow. The first kick drifts the particles
+// the whole step at once and the density rate is taken at the midpoints r(t + dt) - dt/2 * v(t + dt/2), so no sweep
+// is spent on a second half drift; the pressure and the collisions ride along the closing kick.
+template <class Policy>
+void Simulation::adami_step(float dt) {
+    begin_step();
+    auto kick_drift = [=](size_t id) {
         pointers.particle_velocity[id] += dt * 0.5f * pointers.dvdt[id]; // v(t + dt/2)
-        pointers.particle_position[id] +=
-            dt * 0.5f * pointers.particle_velocity[id]; // r(t+dt/2) = r(t) + dt/2 * v(t + dt/2)
-    });
+        pointers.particle_position[id] += dt * pointers.particle_velocity[id]; // r(t + dt) = r(t) + dt * v(t + dt/2)
+    };
+    auto kick_close = [=](size_t id) {
+        const vec3 start = pointers.particle_position[id] - dt * pointers.particle_velocity[id]; // r(t)
+        pointers.particle_velocity[id] += dt * 0.5f * pointers.dvdt[id];
+        pointers.P[id] = P(id);
+        collide(pointers.particle_position[id], pointers.particle_velocity[id], start);
+    };
+    if (symmetric_pairs) {
+        // the pair sums need cleared and finished arrays, that is done by the sweeps next to them
+        const vec3 gravity = Policy::gravity ? vec3(0.0, -0.98, 0.0) : vec3(0.0);
+        auto finish_dvdt = [=](size_t id) {
+            pointers.dvdt[id] = pointers.dvdt[id] + gravity + mag_acceleration<Policy>(id);
+            if constexpr (Policy::checks)
+                CHECK(!glm::any(glm::isnan(pointers.dvdt[id])));
+        };
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) { pointers.dvdt[id] = vec3(0.0f); });
+        add_pair_dvdt<Policy>();
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            finish_dvdt(id);
+            kick_drift(id);
+            pointers.drhodt[id] = 0.0f;
+        });
+        add_pair_drhodt<Policy>(0.5f * dt);
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            pointers.density[id] += dt * pointers.drhodt[id]; // rho(t+dt) = rho(t) + dt * drhodt(t + dt/2)
+            pointers.dvdt[id] = vec3(0.0f);
+        });
+        refresh_magnetic_force_if_due();
+        add_pair_dvdt<Policy>();
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            finish_dvdt(id);
+            kick_close(id);
+        });
+        return;
+    }
+    compute_dvdt<Policy>();
+    tbb::parallel_for(size_t(0), num_particles, kick_drift);
+    if (use_simd_sph()) {
+        const auto constants = sph_constants();
+        sph_simd.load(pointers.particle_position, pointers.particle_velocity, pointers.P, pointers.density,
+                      num_particles, 0.5f * dt);
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            pointers.density[id] += dt * sph_simd.drhodt(constants, id, neighbors.list(id), neighbors.count(id));
+        });
+    } else {
+        tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
+            vec3 unused;
+            float rate;
+            fused_terms<Policy, false, true>(id, unused, rate, 0.5f * dt);
+            pointers.density[id] += dt * rate; // rho(t+dt) = rho(t) + dt * drhodt(t + dt/2)
+        });
+    }
+    refresh_magnetic_force_if_due();
+    compute_dvdt<Policy>();
+    tbb::parallel_for(size_t(0), num_particles, kick_close);
+}
+void Simulation::run_step_implicit(float dt) {
+    update_kernel_tables();
+    with_step_policy([&](auto policy) { implicit_step<decltype(policy)>(dt); });
+    sim_time += dt;
+}
+template <class Policy>
+vec3 Simulation::grad_W(const vec3 &rab) const {
+    if constexpr (Policy::tables)
+        return kernel_tables.dW_r(dot(rab, rab)) * rab;
+    else
+        return gradW(rab, dh);
+}
+// pressure acceleration -sum_b m (p_a / rho_a^2 + p_b / rho_b^2) grad W_ab of every particle, as in fused_terms
+template <class Policy>
+void Simulation::pressure_acceleration(const float *p, vec3 *out) {
     tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
-        pointers.density[id] += dt * drhodt(id); // rho(t+dt) = rho(t) + dt * drhodt(t + dt/2)
+        const vec3 ra = pointers.particle_position[id];
+        const float rho_a = pointers.density[id];
+        const float pa = p[id] / (rho_a * rho_a);
+        vec3 a(0.0f);
+        for_each_neighbor(id, [&](uint32_t b) {
+            const float rho_b = pointers.density[b];
+            a += -mass * (pa + p[b] / (rho_b * rho_b)) * grad_W<Policy>(ra - pointers.particle_position[b]);
+        });
+        out[id] = a;
     });
-    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
-        pointers.particle_position[id] +=
-            dt * 0.5f * pointers.particle_velocity[id]; // r(t+dt) = r(t+dt/2) + dt/2 * v(t+dt/2)
+}
+// IISPH (Ihmsen et al. 2014). The pressure of every step is solved for so that the density after the pressure
+// forces is rho0, by relaxed Jacobi iterations warm started from half the pressure of the previous step. Density is
+// still advected by the continuity equation as in run_step_adami, so the solve also removes its drift.
+template <class Policy>
+void Simulation::implicit_step(float dt) {
+    begin_step();
+    auto &ip = implicit_pressure;
+    ip.pressure.resize(num_particles);
+    ip.guess.resize(num_particles);
+    ip.source.resize(num_particles);
+    ip.a_ii.resize(num_particles);
+    ip.a_p.resize(num_particles);
+    // everything but pressure, the previous pressure is kept as the initial guess
+    tbb::parallel_for(size_t(0), num_particles, [&](size_t id) {
+        ip.guess[id] = 0.5f * pointers.P[id];
+        ip.pressure[id] = ip.guess[id];
+        pointers.P[id] = 0.0f;
     });
-    if (n_iter % 10 == 0) {
-        if (enable_ferro) {
-            printf("compute magnetic force; iter=%zu\n", n_iter);
-            compute_magenetic_force();
-        } else {
-            printf("iter=%zu\n", n_iter);
+    compute_dvdt<Policy>();
+    tbb::parallel_for(size_t(0), num_particles,
+                      [=](size_t id) { pointers.particle_velocity[id] += dt * pointers.dvdt[id]; });
+    // source term rho0 - rho_adv from the advected velocities and the diagonal a_ii of the pressure system
+    tbb::parallel_for(size_t(0), num_particles, [&](size_t id) {
+        const vec3 ra = pointers.particle_position[id];
+        const vec3 va = pointers.particle_velocity[id];
+        float rate = 0.0f, grad2 = 0.0f;
+        vec3 grad_sum(0.0f);
+        for_each_neighbor(id, [&](uint32_t b) {
+            const vec3 grad = grad_W<Policy>(ra - pointers.particle_position[b]);
+            rate += mass * dot(va - pointers.particle_velocity[b], grad);
+            grad_sum += grad;
+            grad2 += dot(grad, grad);
+        });
+        const float rho = pointers.density[id];
+        ip.source[id] = rho0 - (rho + dt * rate);
+        ip.a_ii[id] = -dt * dt * mass * mass / (rho * rho) * (dot(grad_sum, grad_sum) + grad2);
+    });
+    // (A p)_a = dt^2 sum_b m (a_p,a - a_p,b) . grad W_ab, the density change caused by the pressure whose
+    // acceleration is in a_p
+    auto apply = [&](size_t id) {
+        const vec3 ra = pointers.particle_position[id];
+        const vec3 a = ip.a_p[id];
+        float Ap = 0.0f;
+        for_each_neighbor(id, [&](uint32_t b) {
+            Ap += mass * dot(a - ip.a_p[b], grad_W<Policy>(ra - pointers.particle_position[b]));
+        });
+        return dt * dt * Ap;
+    };
+    if (ip.omega <= 0.0f || ip.steps_since_estimate >= pressure_omega_interval) {
+        // Jacobi converges while omega stays below 2 / lambda_max(D^-1 A), which grows with the number of neighbors.
+        // lambda_max is estimated by power iteration from a pattern of random signs, again every
+        // pressure_omega_interval steps as the neighborhoods change.
+        std::vector<float> x(num_particles), y(num_particles);
+        tbb::parallel_for(size_t(0), num_particles,
+                          [&](size_t id) { x[id] = (uint32_t(id) * 2654435761u) >> 31 ? 1.0f : -1.0f; });
+        float lambda = 0.0f;
+        for (int k = 0; k < 20; k++) {
+            pressure_acceleration<Policy>(x.data(), ip.a_p.data());
+            tbb::parallel_for(size_t(0), num_particles,
+                              [&](size_t id) { y[id] = ip.a_ii[id] != 0.0f ? apply(id) / ip.a_ii[id] : 0.0f; });
+            double xx = 0.0, yy = 0.0;
+            for (size_t id = 0; id < num_particles; id++) {
+                xx += double(x[id]) * x[id];
+                yy += double(y[id]) * y[id];
+            }
+            if (yy == 0.0)
+                break;
+            lambda = float(std::sqrt(yy / xx));
+            const float scale = float(std::sqrt(xx / yy));
+            tbb::parallel_for(size_t(0), num_particles, [&](size_t id) { x[id] = y[id] * scale; });
         }
+        ip.omega = lambda > 0.0f ? pressure_omega * 2.0f / lambda : pressure_omega;
+        ip.steps_since_estimate = 0;
     }
-    tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
-        vec3 dvdt = dvdt_full(id);
-        vec3 f = pointers.particle_mag_force[id];
-        // CHECK(!glm::any(glm::isnan(f)));
-        if (!glm::any(glm::isnan(f)))
-            pointers.dvdt[id] = dvdt + f / mass; // Insert magnetic force here
+    ip.steps_since_estimate++;
+    int iter = 0, growing = 0;
+    float error = 0.0f, previous = std::numeric_limits<float>::infinity();
+    for (; iter < pressure_max_iterations; iter++) {
+        pressure_acceleration<Policy>(ip.pressure.data(), ip.a_p.data());
+        // the error is the average compression that remains
+        error = tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, num_particles), 0.0f,
+            [&](const tbb::blocked_range<size_t> &r, float e) {
+                for (size_t id = r.begin(); id < r.end(); id++) {
+                    const float residual = ip.source[id] - apply(id);
+                    e += std::max(0.0f, -residual);
+                    const float a_ii = ip.a_ii[id];
+                    ip.pressure[id] =
+                        a_ii != 0.0f ? std::max(0.0f, ip.pressure[id] + ip.omega * residual / a_ii) : 0.0f;
+                    if constexpr (Policy::checks)
+                        CHECK(!std::isnan(ip.pressure[id]));
+                }
+                return e;
+            },
+            [](float a, float b) { return a + b; });
+        error /= num_particles * rho0;
+        if (iter > 0 && error <= pressure_tolerance) {
+            iter++;
+            break;
+        }
+        // the estimate can fall short as neighborhoods fill up: once the error keeps growing, halve omega for good
+        // and start over
+        growing = error > previous ? growing + 1 : 0;
+        previous = error;
+        if (growing == 2) {
+            ip.omega *= 0.5f;
+            std::copy(ip.guess.begin(), ip.guess.end(), ip.pressure.begin());
+            previous = std::numeric_limits<float>::infinity();
+            growing = 0;
+        }
+    }
+    if (log_pressure_solve)
+        printf("pressure solve: %d iterations, density error %e\n", iter, error);
+    pressure_acceleration<Policy>(ip.pressure.data(), ip.a_p.data());
+    tbb::parallel_for(size_t(0), num_particles, [&](size_t id) {
+        pointers.particle_velocity[id] += dt * ip.a_p[id];
+        pointers.dvdt[id] += ip.a_p[id];
+        pointers.P[id] = ip.pressure[id];
     });
     tbb::parallel_for(size_t(0), num_particles, [=](size_t id) {
-        pointers.particle_velocity[id] += dt * 0.5f * pointers.dvdt[id];
-        pointers.P[id] = P(id);
+        vec3 unused;
+        float rate;
+        fused_terms<Policy, false, true>(id, unused, rate);
+        pointers.density[id] += dt * rate;
     });
+    tbb::parallel_for(size_t(0), num_particles,
+                      [=](size_t id) { pointers.particle_position[id] += dt * pointers.particle_velocity[id]; });
     naive_collison_handling();
-    // printf("step done\n");
+    refresh_magnetic_force_if_due();
+}
+// finest level whose step, sub-steps of dt / 2^(block_levels - 1), is within the CFL and force limits of the particle
+int Simulation::block_level(size_t id, float dt) const {
+    const vec3 v = pointers.particle_velocity[id], a = pointers.dvdt[id];
+    float limit = sph_cfl * dh / (c0 + length(v));
+    if (dot(a, a) > 0.0f)
+        limit = std::min(limit, sph_force_cfl * std::sqrt(dh / length(a)));
+    int level = 0;
+    while (level < block_levels - 1 && dt / float(1 << level) > limit)
+        level++;
+    return level;
+}
+void Simulation::run_step_block(float dt) {
+    update_kernel_tables();
+    with_step_policy([&](auto policy) { block_step<decltype(policy)>(dt); });
+    sim_time += dt;
+}
+// Block time steps: dt is covered in n = 2^(block_levels - 1) sub-steps and a particle on level l only takes
+// kick-drift-kick steps of n / 2^l sub-steps. Every sub-step drifts all particles with their half step velocity,
+// which is exact, and predicts the velocity and density of the particles in the middle of a step from their last
+// rates. Only the particles at the end of their step evaluate forces, close their step and open the next one, on a
+// level that may be coarser only where that level's steps begin.
+template <class Policy>
+void Simulation::block_step(float dt) {
+    begin_step();
+    auto &bs = block;
+    const uint32_t n = 1u << (block_levels - 1);
+    const float sub = dt / n;
+    for (auto *v : {&bs.v_half, &bs.accel})
+        v->resize(num_particles);
+    for (auto *v : {&bs.rho_start, &bs.rate})
+        v->resize(num_particles);
+    bs.level.resize(num_particles);
+    bs.start.resize(num_particles);
+    auto length_of = [&](size_t id) { return n >> bs.level[id]; };
+    auto rates = [&](size_t id) {
+        float rate;
+        fused_terms<Policy, true, true>(id, pointers.dvdt[id], rate);
+        bs.mag_accel[id] = mag_acceleration<Policy>(id);
+        pointers.dvdt[id] += bs.mag_accel[id];
+        pointers.drhodt[id] = rate;
+    };
+    // all particles are synchronized at the start. The last sub-step of the previous block step evaluated every
+    // particle in this state, so its rates are reused and only the magnetic force, which may have been refreshed
+    // since, is swapped in; otherwise everything is evaluated.
+    if (bs.rates_time == sim_time && bs.mag_accel.size() == num_particles) {
+        tbb::parallel_for(size_t(0), num_particles, [&](size_t id) {
+            const vec3 a = mag_acceleration<Policy>(id);
+            pointers.dvdt[id] += a - bs.mag_accel[id];
+            bs.mag_accel[id] = a;
+        });
+    } else {
+        bs.mag_accel.resize(num_particles);
+        tbb::parallel_for(size_t(0), num_particles, [&](size_t id) { rates(id); });
+    }
+    tbb::parallel_for(size_t(0), num_particles, [&](size_t id) { bs.level[id] = (uint8_t)block_level(id, dt); });
+    // no particle more than one level coarser than its finest neighbor, so that it notices a fast neighbor in time.
+    // Raising a particle can leave its own neighbors two levels behind, so repeat until nothing changes, at most
+    // block_levels passes.
+    for (bool changed = true; changed;) {
+        const std::vector<uint8_t> level(bs.level);
+        changed = tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, num_particles), false,
+            [&](const tbb::blocked_range<size_t> &r, bool c) {
+                for (size_t id = r.begin(); id < r.end(); id++) {
+                    for_each_neighbor(id, [&](uint32_t b) {
+                        if (level[b] > bs.level[id] + 1) {
+                            bs.level[id] = level[b] - 1;
+                            c = true;
+                        }
+                    });
+                }
+                return c;
+            },
+            [](bool a, bool b) { return a || b; });
+    }
+    auto open = [&](size_t id, uint32_t s) {
+        const float step = sub * length_of(id);
+        bs.accel[id] = pointers.dvdt[id];
+        bs.rate[id] = pointers.drhodt[id];
+        bs.v_half[id] = pointers.particle_velocity[id] + 0.5f * step * bs.accel[id];
+        bs.rho_start[id] = pointers.density[id];
+        bs.start[id] = s;
+    };
+    tbb::parallel_for(size_t(0), num_particles, [&](size_t id) { open(id, 0); });
+    size_t updates = 0;
+    for (uint32_t s = 1; s <= n; s++) {
+        // drift everything to the end of the sub-step, predict velocity and density of the particles mid step
+        tbb::parallel_for(size_t(0), num_particles, [&](size_t id) {
+            const float step = sub * length_of(id);
+            const float elapsed = sub * (s - bs.start[id]);
+            pointers.particle_position[id] += sub * bs.v_half[id];
+            pointers.particle_velocity[id] = bs.v_half[id] + (elapsed - 0.5f * step) * bs.accel[id];
+            pointers.density[id] = bs.rho_start[id] + elapsed * bs.rate[id];
+            pointers.P[id] = P(id);
+        });
+        update_neighbors();
+        auto active = [&](size_t id) { return s - bs.start[id] == length_of(id); };
+        tbb::parallel_for(size_t(0), num_particles, [&](size_t id) {
+            if (active(id))
+                rates(id);
+        });
+        updates += tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, num_particles), size_t(0),
+            [&](const tbb::blocked_range<size_t> &r, size_t count) {
+                for (size_t id = r.begin(); id < r.end(); id++) {
+                    if (!active(id))
+                        continue;
+                    count++;
+                    // close the step with the new rates, the density with the average of both ends
+                    const float step = sub * length_of(id);
+                    pointers.particle_velocity[id] = bs.v_half[id] + 0.5f * step * pointers.dvdt[id];
+                    pointers.density[id] = bs.rho_start[id] + 0.5f * step * (bs.rate[id] + pointers.drhodt[id]);
+                    pointers.P[id] = P(id);
+                    collide(pointers.particle_position[id], pointers.particle_velocity[id],
+                            pointers.particle_position[id] - step * bs.v_half[id]);
+                    int l = block_level(id, dt);
+                    while (s % (n >> l) != 0)
+                        l++;
+                    bs.level[id] = (uint8_t)l;
+                    open(id, s);
+                }
+                return count;
+            },
+            [](size_t a, size_t b) { return a + b; });
+    }
+    if (log_dt)
+        printf("iter=%zu block steps: %.1f%% of the particle updates of uniform sub-steps\n", n_iter,
+               100.0 * updates / (double(n) * num_particles));
+    bs.rates_time = sim_time + dt;
+    refresh_magnetic_force_if_due();
+}
+// one step of the selected integrator
+void Simulation::advance(float dt) {
+    // the block steps integrate the Tait pressure particle by particle, there is no global solve to fit into them
+    CHECK(!(block_timesteps && pressure_solver == PressureSolver::Implicit));
+    if (block_timesteps)
+        run_step_block(dt);
+    else if (pressure_solver == PressureSolver::Implicit)
+        run_step_implicit(dt);
+    else
+        run_step_adami(dt);
+}
+void Simulation::run_step_multirate() {
+    // the magnetic force is the slow part: SPH takes as many CFL limited sub-steps as needed to cover dt and the
+    // magnetic force is only refreshed between them when magnetic_refresh_due says so. The sub-steps are bounded
+    // like those of run_step_adaptive, so a blow-up cannot stall the frame in near zero steps.
+    float t = 0.0f;
+    while (t < dt * (1.0f - 1e-4f)) {
+        float sub = std::min(glm::clamp(sph_substep(), dt_min, dt_max), dt - t);
+        advance(sub);
+        t += sub;
+    }
+}
+
+void Simulation::run_step_adaptive() {
+    const char *limit;
+    const float step = sph_substep(&limit);
+    const float clamped = glm::clamp(step, dt_min, dt_max);
+    if (clamped != step)
+        limit = step < dt_min ? "dt_min" : "dt_max";
+    if (log_dt)
+        printf("iter=%zu dt=%e (%s)\n", n_iter, clamped, limit);
+    advance(clamped);
 }
+
 void Simulation::run_step() {
-    run_step_adami();
+    if (multirate)
+        run_step_multirate();
+    else if (adaptive_dt)
+        run_step_adaptive();
+    else
+        advance(dt);
     n_iter++;
 }
@@ -2,6 +2,17 @@
 // #include <cuda.h>
 // #include <cuda_runtime.h>
 // #define GLM_FORCE_CUDA
+#include "barnes_hut.h"
+#include "collider.h"
+#include "direct_sum.h"
+#include "external_field.h"
+#include "fmm.h"
+#include "hashed_grid.h"
+#include "kernel_table.h"
+#include "near_field.h"
+#include "neighbor_list.h"
+#include "p3m.h"
+#include "sph_simd.h"
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 #include <Eigen/Sparse>
@@ -11,6 +22,7 @@
 #include <cstdint>
 #include <glm/glm.hpp>
 #include <memory>
+#include <tbb/task_group.h>
 #include <vector>
 
 #pragma warning(disable : 4244)
@@ -49,20 +61,39 @@ using glm::vec3;
         }                                                                                                              \
     }()
 static constexpr double pi = 3.1415926535897;
+// how the interparticle magnetic force and the field in the magnetization solve are summed
+enum class MagneticSolver {
+    Direct,    // O(N^2) pairwise sum
+    BarnesHut, // octree of aggregated dipoles, controlled by bh_theta
+    FMM,       // fast multipole method for pairs beyond 4h, exact near field
+    P3M,       // particle-particle particle-mesh, cost set by the mesh resolution p3m_cell_size
+};
+// compile time configuration of the SPH step: the step is instantiated for every combination of the runtime flags
+// and Simulation::with_step_policy picks the matching one, so the particle loops carry no branches on the flags
+template <bool Gravity, bool Ferro, bool Tables>
+struct StepPolicy {
+    static constexpr bool gravity = Gravity; // enable_gravity
+    static constexpr bool ferro = Ferro;     // enable_ferro, particle_mag_force is added to dvdt
+    static constexpr bool tables = Tables;   // use_kernel_tables
+#ifdef NDEBUG
+    static constexpr bool checks = false; // NaN checks in the particle loops, debug builds only
+#else
+    static constexpr bool checks = true;
+#endif
+};
+// how the SPH pressure is found
+enum class PressureSolver {
+    Tait,     // weakly compressible, the Tait equation of the advected density (run_step_adami)
+    Implicit, // IISPH, solved every step so that the density stays at rho0 (run_step_implicit)
+};
+// when the magnetic force is recomputed, it is held constant in between
+enum class MagneticRefresh {
+    Fixed,    // every magnetic_refresh_interval steps
+    Adaptive, // once a particle moved magnetic_refresh_displacement * h since the last refresh
+};
 class Simulation {
   public:
     const double mu0 = 1.25663706212e-6;
-    struct Cell {
-        static constexpr size_t max_particles = 100;
-        std::array<uint32_t, max_particles> particles;
-        std::atomic<uint32_t> n_particles;
-        Cell() : n_particles(0) {}
-    };
-    struct Neighbors {
-        static constexpr size_t max_neighbors = 200;
-        std::array<uint32_t, max_neighbors> neighbors;
-        size_t n_neighbors = 0;
-    };
     // if we want to port to cuda but not want to port a std::vector (since they simply don't have __device__ attached)
     // this is our best chance
     struct Buffers {
@@ -73,13 +104,21 @@ class Simulation {
         std::unique_ptr<vec3[]> particle_M;
         std::unique_ptr<vec3[]> particle_mag_moment;
         std::unique_ptr<vec3[]> particle_mag_force;
+        std::unique_ptr<vec3[]> mag_force_position; // positions at the last magnetic force refresh
+        std::unique_ptr<vec3[]> next_mag_force;     // written by the background magnetic force job
         std::unique_ptr<vec3[]> Hext;
+        std::unique_ptr<mat3[]> Hext_grad;
+        std::unique_ptr<vec3[]> neighbor_position; // positions at the last neighbor list build
         std::unique_ptr<float[]> density;
         std::unique_ptr<vec3[]> dvdt;
         std::unique_ptr<float[]> drhodt;
         std::unique_ptr<float[]> P;
-        std::unique_ptr<Cell[]> grid;
-        std::unique_ptr<Neighbors[]> neighbors;
+        // compact grid: the particles of cell c are cell_particles[cell_start[c] .. cell_start[c + 1])
+        std::unique_ptr<uint32_t[]> cell_start; // one entry per cell plus the end sentinel
+        std::unique_ptr<std::atomic<uint32_t>[]> cell_fill;
+        std::unique_ptr<uint32_t[]> cell_particles; // particle ids sorted by cell, ascending within a cell
+        std::unique_ptr<uint32_t[]> particle_cell;
+        std::unique_ptr<uint32_t[]> particle_id; // stable id (initial index) of the particle stored at each slot
         size_t num_particles = 0;
     };
     struct Pointers {
@@ -89,13 +128,20 @@ class Simulation {
         vec3 *particle_M = nullptr;
         vec3 *particle_mag_moment = nullptr;
         vec3 *particle_mag_force = nullptr;
+        vec3 *mag_force_position = nullptr;
+        vec3 *next_mag_force = nullptr;
         vec3 *Hext = nullptr;
+        mat3 *Hext_grad = nullptr;
+        vec3 *neighbor_position = nullptr;
         float *density = nullptr;
         vec3 *dvdt = nullptr;
         float *drhodt = nullptr;
         float *P = nullptr;
-        Cell *grid = nullptr;
-        Neighbors *neighbors = nullptr;
+        uint32_t *cell_start = nullptr;
+        std::atomic<uint32_t> *cell_fill = nullptr;
+        uint32_t *cell_particles = nullptr;
+        uint32_t *particle_cell = nullptr;
+        uint32_t *particle_id = nullptr;
     };
     void init();
     float radius = 0.02f;
@@ -117,8 +163,79 @@ class Simulation {
     float susceptibility = 0.8;                      // material susceptibility
     float Gamma = pow(radius, 3) * (susceptibility / (1 + susceptibility));
     ivec3 grid_size;
-    dvec3 dipole = dvec3(0.5, -0.6, 0.5);
-    dvec3 m = dvec3(0, 1e5, 0);
+    ExternalField external_field; // the magnets, a single dipole below the pool by default (see init)
+    MagneticSolver magnetic_solver = MagneticSolver::Direct;
+    DipoleDirect direct;
+    int fmm_order = 4;      // multipole expansion order
+    float fmm_theta = 0.5f; // multipole acceptance criterion, smaller is more accurate
+    DipoleFMM fmm;
+    float bh_theta = 0.5f; // Barnes-Hut opening angle, 0 degenerates to the direct sum
+    BarnesHut barnes_hut;
+    float p3m_cell_size = 0.5f * h; // P3M mesh spacing
+    float p3m_splitting = 0.3f;     // P3M Ewald splitting times mesh spacing, smaller is more accurate
+    DipoleP3M p3m;
+    NearFieldTensor near_field; // C1/C2 tensor of every pair closer than 4h, shared by all solvers
+    int magnetization_max_iterations = 50;
+    float magnetization_tolerance = 1e-4f; // relative residual of the magnetization solve
+    Eigen::VectorXd magnetization_guess;   // previous solution, warm starts the next solve
+    MagneticRefresh magnetic_refresh = MagneticRefresh::Fixed;
+    int magnetic_refresh_interval = 10;          // Fixed: steps between refreshes
+    float magnetic_refresh_displacement = 0.25f; // Adaptive: displacement threshold in units of h
+    int magnetic_refresh_max_interval = 200;     // Adaptive: refresh at least this often
+    int steps_since_magnetic_refresh = -1;       // -1 until the first refresh
+    PressureSolver pressure_solver = PressureSolver::Tait;
+    int pressure_max_iterations = 100;
+    float pressure_tolerance = 1e-3f; // Implicit: average compression relative to rho0 at which the solve stops
+    float pressure_omega = 0.5f;      // Implicit: Jacobi relaxation as a fraction of the largest stable one
+    int pressure_omega_interval = 50; // Implicit: steps between estimates of the largest stable relaxation
+    bool log_pressure_solve = true;
+    struct ImplicitPressure {
+        std::vector<float> pressure, guess, source, a_ii;
+        std::vector<vec3> a_p; // pressure acceleration
+        float omega = 0.0f;    // relaxation in use, halved when the solve diverged until the next estimate
+        int steps_since_estimate = 0;
+    } implicit_pressure;
+    // run_step covers dt in 2^(block_levels - 1) sub-steps, each particle stepping at the coarsest power of two its own
+    // CFL and force limits allow, see run_step_block. Works best with neighbor_skin, the lists are updated every
+    // sub-step. Not combined with PressureSolver::Implicit.
+    bool block_timesteps = false;
+    int block_levels = 4;
+    struct BlockState {
+        std::vector<uint8_t> level;
+        std::vector<uint32_t> start; // sub-step the current step of the particle began at
+        std::vector<vec3> v_half, accel;
+        std::vector<float> rho_start, rate;
+        std::vector<vec3> mag_accel; // magnetic part of dvdt
+        float rates_time = -1.0f;    // sim_time at which dvdt and drhodt hold the rates of every particle
+    } block;
+    // run_step covers dt with SPH sub-steps of sph_substep within [dt_min, dt_max], see run_step_multirate
+    bool multirate = false;
+    // safety factors of the three limits of sph_substep
+    float sph_cfl = 0.25f;          // sph_cfl * dh / (c0 + max speed)
+    float sph_force_cfl = 0.25f;    // sph_force_cfl * sqrt(dh / max |dvdt|), dvdt includes the magnetic force
+    float sph_viscous_cfl = 0.125f; // sph_viscous_cfl * dh^2 / nu, nu = alpha dh c0 / 10 of the artificial viscosity
+    // run_step takes one step of sph_substep clamped to [dt_min, dt_max] instead of dt
+    bool adaptive_dt = false;
+    float dt_min = 1e-6f;
+    float dt_max = 1e-3f;
+    bool log_dt = true;    // print every adaptive dt and the limit that set it
+    double sim_time = 0.0; // simulated time, advanced by every step
+    // compute the magnetic force in the background on the positions of the refresh step while SPH keeps going, the
+    // result replaces the current force at the first step boundary after it is done
+    bool async_magnetic_force = false;
+    // every per-particle buffer is periodically sorted along a Morton curve of the grid cells so that neighbors sit
+    // close in memory, particle_id maps the slots back to the initial particle order. Locality is measured as the
+    // number of runs of equal cells along the particle order.
+    int reorder_interval = 0;         // sort every this many steps, 0 disables
+    float reorder_degradation = 0.0f; // also sort once the runs grew by this factor since the last sort, 0 disables
+    int steps_since_reorder = -1;     // -1 until the first sort
+    size_t sorted_cell_runs = 0;      // runs right after the last sort
+    struct MagneticJob {
+        tbb::task_group group;
+        std::atomic<bool> done{false};
+        bool pending = false;
+        ~MagneticJob() { group.wait(); }
+    };
     uint32_t get_index_i(const ivec3 &p) const { return p.x + p.y * grid_size.x + p.z * grid_size.x * grid_size.y; }
     ivec3 get_cell(const vec3 &p) const {
         ivec3 ip = p * vec3(grid_size);
@@ -134,14 +251,96 @@ class Simulation {
 
     vec3 lower = vec3(0);
     vec3 upper = vec3(1);
+    Collider collider; // mesh obstacles and containers, on top of the box lower / upper
+    NeighborList neighbors; // particles closer than 2 dh + neighbor_skin
+    // Verlet skin: the lists are only rebuilt once a particle moved more than half of it, the SPH loops filter the
+    // extra pairs. 0 rebuilds the grid and the lists every step.
+    float neighbor_skin = 0.0f;
+    bool neighbor_lists_valid = false;
+    // hash only the occupied cells instead of the dense grid over the unit cube, for scenes of any extent
+    bool sparse_grid = false;
+    HashedGrid hashed_grid;
+    void resize_grid();
     void build_grid();
+    // calls f(particles, begin, end) for index ranges that together hold every particle of the 27 cells around p
+    template <class F>
+    void for_each_cell_range(const vec3 &p, F &&f) const;
     void find_neighbors();
+    void update_neighbors();
+    // calls f(b) for every particle b within 2 dh of id
+    template <class F>
+    void for_each_neighbor(size_t id, F &&f) {
+        if (neighbor_skin <= 0.0f) {
+            neighbors.for_each(id, f);
+            return;
+        }
+        const vec3 ra = pointers.particle_position[id];
+        const float r2 = 4.0f * dh * dh;
+        neighbors.for_each(id, [&](uint32_t b) {
+            const vec3 rab = ra - pointers.particle_position[b];
+            if (dot(rab, rab) < r2)
+                f(b);
+        });
+    }
+    bool reorder_due();
+    void reorder_particles();
     vec3 dvdt_momentum_term(size_t id);
     vec3 dvdt_viscosity_term(size_t id);
     vec3 dvdt_tension_term(size_t id);
     vec3 dvdt_full(size_t id);
     float drhodt(size_t id);
+    // calls f(StepPolicy<...>()) for the current enable_gravity, enable_ferro and kernel tables
+    template <class F>
+    void with_step_policy(F &&f);
+    // dvdt_full and / or drhodt in a single neighbor sweep, the separate functions above are kept for debugging. With
+    // rewind set the terms are taken at the positions r - rewind * v.
+    template <class Policy, bool Force, bool Density>
+    void fused_terms(size_t id, vec3 &dvdt, float &drhodt, float rewind = 0.0f);
+    // run fused_terms as float SIMD kernels over a SoA copy of the particles, needs uncompressed neighbor lists
+    bool simd_sph = false;
+    SphSimd sph_simd;
+    bool use_simd_sph() const { return simd_sph && !symmetric_pairs && !neighbors.compressed; }
+    SphSimd::Constants sph_constants() const { return {dh, h, mass, c0, alpha, tension}; }
+    // dW / r, the tension cosine, W, W_avr and the radial part of H tabulated over r^2 for the current h and dh, used
+    // by fused_terms, the pair traversal and the magnetization near field instead of the analytic kernels when set
+    bool use_kernel_tables = false;
+    struct KernelTables {
+        KernelTable dW_r;          // SPH spline derivative over r, support 2 dh
+        KernelTable tension_cos;   // cos(3 pi r / 2h) within h, 0 beyond
+        KernelTable W, W_avr;      // magnetic kernels, support 2h
+        KernelTable H_r;           // (W_avr - W) / r^2
+        float h = 0.0f, dh = 0.0f; // what the tables were built for
+        bool ready = false;
+    } kernel_tables;
+    bool kernel_tables_ready() const { return use_kernel_tables && kernel_tables.ready; }
+    void build_kernel_tables();
+    // with use_kernel_tables, builds the tables and checks them against the analytic kernels if they are missing or h
+    // or dh changed since they were built. Both join a pending magnetic force job, which reads the tables.
+    void update_kernel_tables();
+    double check_kernel_tables(); // largest error of any table relative to its largest value
+    // evaluate every pair once over a half stencil of grid cells and scatter to both particles, instead of once from
+    // each side through the neighbor lists
+    bool symmetric_pairs = false;
+    // calls f(a, b, ra - rb) once for every pair closer than 2 dh, calls never run concurrently on a shared particle;
+    // with rewind set the positions are r - rewind * v
+    template <class F>
+    void for_each_pair(F &&f, float rewind = 0.0f);
+    template <class Policy>
+    void pair_dvdt(); // dvdt_full of every particle into dvdt
+    template <class Policy>
+    void add_pair_dvdt(); // the pair terms of dvdt_full, without gravity, added to dvdt
+    template <class Policy>
+    void pair_drhodt(); // drhodt of every particle into drhodt
+    template <class Policy>
+    void add_pair_drhodt(float rewind = 0.0f); // drhodt added to drhodt, at r - rewind * v
+    template <class Policy>
+    vec3 mag_acceleration(size_t id) const;
+    template <class Policy>
+    void compute_dvdt();
+    void compute_dvdt(); // SPH and magnetic acceleration into dvdt
     void naive_collison_handling();
+    // box and collider collisions, previous is a position outside the solids to fall back to (see Collider::collide)
+    void collide(vec3 &p, vec3 &v, const vec3 &previous) const;
     float P(size_t id);
     vec3 H(vec3 r, vec3 m);
     Eigen::Matrix3d H_mat(vec3 r, vec3 m);
@@ -149,21 +348,53 @@ class Simulation {
     float W(vec3 r);
     float dWdr(vec3 r);
     void eval_Hext();
-    void get_R(Eigen::Matrix3d &R, const Eigen::Vector3d &rt, const Eigen::Vector3d &rs);
-    float get_C1(float q);
-    float get_C2(float q);
-    void get_T_hat(Eigen::Matrix3d &Ts, const Eigen::Vector3d &m_hat_s, float q);
     void get_Force_Tensor(Eigen::Matrix3d &Ts, const Eigen::Vector3d &rt, const Eigen::Vector3d &rs,
                           const Eigen::Vector3d &ms);
+    void interparticle_force_tensor_direct(Eigen::Matrix3d *U);
+    void interparticle_force_tensor_barnes_hut(Eigen::Matrix3d *U);
+    void interparticle_force_tensor_fmm(Eigen::Matrix3d *U);
+    void interparticle_force_tensor_p3m(Eigen::Matrix3d *U);
     void compute_m(const Eigen::VectorXd &b);
-    void magnetization();
+    void apply_magnetization_operator(const Eigen::VectorXd &x, Eigen::VectorXd &y);
+    void solve_magnetization(const Eigen::VectorXd &hext, Eigen::VectorXd &b);
     void compute_magenetic_force();
+    float max_displacement(const vec3 *since); // largest distance of a particle to its position in since
+    float max_mag_force_displacement() { return max_displacement(pointers.mag_force_position); }
+    bool magnetic_refresh_due();
+    void refresh_magnetic_force();
+    void launch_magnetic_force();
+    void finish_magnetic_force(bool wait);
+    // largest stable SPH step, limit (if not null) receives the name of the criterion that set it
+    float sph_substep(const char **limit = nullptr);
 
     void run_step_euler();
-    void run_step_adami();
+    void run_step_adami() { run_step_adami(dt); }
+    void run_step_adami(float dt);
+    template <class Policy>
+    void euler_step();
+    template <class Policy>
+    void adami_step(float dt);
+    void run_step_implicit(float dt);
+    template <class Policy>
+    void implicit_step(float dt);
+    template <class Policy>
+    vec3 grad_W(const vec3 &rab) const;
+    template <class Policy>
+    void pressure_acceleration(const float *p, vec3 *out);
+    void begin_step();
+    void refresh_magnetic_force_if_due();
+    int block_level(size_t id, float dt) const;
+    void run_step_block(float dt);
+    template <class Policy>
+    void block_step(float dt);
+    void advance(float dt); // run_step_block, run_step_adami or run_step_implicit
+    void run_step_multirate();
+    void run_step_adaptive();
 
     Buffers buffers;
     Pointers pointers;
+    Pointers mag_pointers; // what the magnetic force code works on, a snapshot while a background job runs
+    std::unique_ptr<MagneticJob> magnetic_job; // declared after everything the job uses so it is joined first
     Simulation(const std::vector<vec3> &particles) : size(size), num_particles(particles.size()) {
         init();
         for (size_t i = 0; i < num_particles; i++) {
@@ -181,7 +412,4 @@ class Simulation {
     void run_step();
 
     void visualize_field(Eigen::MatrixXd &P, Eigen::MatrixXi &F);
-
-    dvec3 Hext(dvec3 r);
-    mat3 dHext(dvec3 r);
 };
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "sph_simd.h"
+#include "simd.h"
+#include <cmath>
+#include <tbb/parallel_for.h>
+
+static constexpr int lanes = SphSimd::lanes;
+static constexpr float pi_f = 3.14159265358979f;
+
+// 1 for x >= 0 and 0 for x < 0 (or -0), a bit operation where comparisons would add to the branches the vectorizer
+// has to if-convert
+static inline float step(float x) { return 0.5f + 0.5f * std::copysign(1.0f, x); }
+
+// cos(x) for x in [0, 2 pi], folded onto [0, pi / 2] and evaluated as a Taylor polynomial up to z^10. The first
+// omitted term bounds the truncation error by (pi / 2)^12 / 12! ~ 4.7e-7, with the float rounding of the folding the
+// error stays below 1e-6.
+static inline float folded_cos(float x) {
+    const float y = std::abs(x - pi_f); // cos(x) = -cos(y)
+    const float flip = step(y - 0.5f * pi_f);
+    const float z = y + flip * (pi_f - 2.0f * y); // cos(y) = -cos(pi - y) past pi / 2
+    const float z2 = z * z;
+    const float c =
+        1.0f + z2 * (-1.0f / 2 + z2 * (1.0f / 24 + z2 * (-1.0f / 720 + z2 * (1.0f / 40320 + z2 * (-1.0f / 3628800)))));
+    return (2.0f * flip - 1.0f) * c;
+}
+
+// derivative of the cubic spline used by Simulation, divided by r; zero for r = 0 and r >= 2 dh
+static inline float dW_over_r(float r2, float dh, float norm) {
+    const float inv_r = (r2 > 0.0f ? 1.0f : 0.0f) / std::sqrt(r2 + 1e-30f);
+    const float q = r2 * inv_r / dh;
+    const float p1 = q <= 1.0f ? 1.0f : 0.0f, p2 = q < 2.0f ? 1.0f : 0.0f;
+    const float t = 2.0f - q;
+    return norm * (p1 * (-3.0f * q + 2.25f * q * q) + (p2 - p1) * (-0.75f * t * t)) * inv_r;
+}
+
+SIMD_CLONES
+static void dvdt_kernel(const float *x, const float *y, const float *z, const float *vx, const float *vy,
+                        const float *vz, const float *pr, const float *rho, const SphSimd::Constants &c, uint32_t a,
+                        const uint32_t *neighbors, size_t count, float out[3]) {
+    constexpr float eps = 0.01f;
+    const float norm = 10.0f / (7.0f * pi_f * c.dh * c.dh) / c.dh;
+    const float r2max = 4.0f * c.dh * c.dh;
+    const float visc = 2.0f * c.alpha * c.dh * c.c0;
+    const float tension_k = 3.0f * pi_f / (2.0f * c.h);
+    const float xa = x[a], ya = y[a], za = z[a], vxa = vx[a], vya = vy[a], vza = vz[a], pra = pr[a], rhoa = rho[a];
+    float acc[3][lanes] = {};
+    for (size_t i = 0; i < count; i += lanes) {
+        for (int l = 0; l < lanes; l++) {
+            const size_t k = i + l;
+            // lanes past the end read the padding of the list and are masked out
+            const int32_t b = neighbors[k];
+            const float rx = xa - x[b], ry = ya - y[b], rz = za - z[b];
+            const float r2 = rx * rx + ry * ry + rz * rz;
+            const float valid = (k < count ? 1.0f : 0.0f) * (r2 < r2max ? 1.0f : 0.0f);
+            const float g = valid * dW_over_r(r2, c.dh, norm); // grad W = g * rab
+            const float vrx = vxa - vx[b], vry = vya - vy[b], vrz = vza - vz[b];
+            const float vr = vrx * rx + vry * ry + vrz * rz;
+            // pressure
+            float s = -c.mass * (pra + pr[b]) * g;
+            // artificial viscosity of approaching particles, 2 alpha dh c0 vr / ((rho_a + rho_b)(r^2 + eps dh^2))
+            const float approaching = 1.0f - step(vr);
+            const float pi_ab = visc / (rhoa + rho[b]) * vr / (r2 + eps * c.dh * c.dh);
+            s += approaching * c.mass * pi_ab * g;
+            // tension, within h
+            const float r = std::sqrt(r2);
+            const float near = valid * step(c.h - r);
+            s += near * c.tension * c.mass * folded_cos(tension_k * r);
+            acc[0][l] += s * rx;
+            acc[1][l] += s * ry;
+            acc[2][l] += s * rz;
+        }
+    }
+    for (int d = 0; d < 3; d++) {
+        float sum = 0.0f;
+        for (int l = 0; l < lanes; l++) {
+            sum += acc[d][l];
+        }
+        out[d] = sum;
+    }
+}
+
+SIMD_CLONES
+static float drhodt_kernel(const float *x, const float *y, const float *z, const float *vx, const float *vy,
+                           const float *vz, const SphSimd::Constants &c, uint32_t a, const uint32_t *neighbors,
+                           size_t count) {
+    const float norm = 10.0f / (7.0f * pi_f * c.dh * c.dh) / c.dh;
+    const float r2max = 4.0f * c.dh * c.dh;
+    const float xa = x[a], ya = y[a], za = z[a], vxa = vx[a], vya = vy[a], vza = vz[a];
+    float acc[lanes] = {};
+    for (size_t i = 0; i < count; i += lanes) {
+        for (int l = 0; l < lanes; l++) {
+            const size_t k = i + l;
+            const int32_t b = neighbors[k];
+            const float rx = xa - x[b], ry = ya - y[b], rz = za - z[b];
+            const float r2 = rx * rx + ry * ry + rz * rz;
+            const float valid = (k < count ? 1.0f : 0.0f) * (r2 < r2max ? 1.0f : 0.0f);
+            const float g = valid * dW_over_r(r2, c.dh, norm);
+            acc[l] += c.mass * g * ((vxa - vx[b]) * rx + (vya - vy[b]) * ry + (vza - vz[b]) * rz);
+        }
+    }
+    float sum = 0.0f;
+    for (int l = 0; l < lanes; l++) {
+        sum += acc[l];
+    }
+    return sum;
+}
+
+void SphSimd::load(const glm::vec3 *position, const glm::vec3 *velocity, const float *P, const float *density,
+                   size_t n, float rewind) {
+    for (auto *v : {&x, &y, &z, &vx, &vy, &vz, &pr, &rho}) {
+        v->resize(n);
+    }
+    tbb::parallel_for(size_t(0), n, [&](size_t i) {
+        x[i] = position[i].x - rewind * velocity[i].x;
+        y[i] = position[i].y - rewind * velocity[i].y;
+        z[i] = position[i].z - rewind * velocity[i].z;
+        vx[i] = velocity[i].x;
+        vy[i] = velocity[i].y;
+        vz[i] = velocity[i].z;
+        pr[i] = P[i] / (density[i] * density[i]);
+        rho[i] = density[i];
+    });
+}
+
+glm::vec3 SphSimd::dvdt(const Constants &c, uint32_t a, const uint32_t *neighbors, size_t count) const {
+    if (count == 0) {
+        return glm::vec3(0.0f);
+    }
+    float out[3];
+    dvdt_kernel(x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data(), pr.data(), rho.data(), c, a,
+                neighbors, count, out);
+    return glm::vec3(out[0], out[1], out[2]);
+}
+
+float SphSimd::drhodt(const Constants &c, uint32_t a, const uint32_t *neighbors, size_t count) const {
+    if (count == 0) {
+        return 0.0f;
+    }
+    return drhodt_kernel(x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data(), c, a, neighbors, count);
+}
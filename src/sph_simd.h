@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <tbb/cache_aligned_allocator.h>
+#include <vector>
+
+// SIMD version of Simulation::fused_terms. The particle state is copied into cache line aligned SoA float arrays and
+// every neighbor list is processed `lanes` entries at a time with gathered loads; the cubic spline derivative, the
+// viscosity switch and the tension cosine are evaluated branch free in float. The kernels carry SIMD_CLONES, so the
+// AVX-512, AVX2 or baseline version is chosen at load time from the running CPU.
+class SphSimd {
+  public:
+    static constexpr int lanes = 16;
+    struct Constants {
+        float dh, h, mass, c0, alpha, tension;
+    };
+
+    // snapshot of the state the kernels read, P is stored as P / rho^2 and the positions as
+    // position - rewind * velocity
+    void load(const glm::vec3 *position, const glm::vec3 *velocity, const float *P, const float *density, size_t n,
+              float rewind = 0.0f);
+    // pressure, viscosity and tension acceleration of particle a (no gravity) over its neighbor ids, which must be
+    // readable (any valid id) up to `lanes` entries past count
+    glm::vec3 dvdt(const Constants &c, uint32_t a, const uint32_t *neighbors, size_t count) const;
+    // density rate of particle a
+    float drhodt(const Constants &c, uint32_t a, const uint32_t *neighbors, size_t count) const;
+
+  private:
+    using Lane = std::vector<float, tbb::cache_aligned_allocator<float>>;
+    Lane x, y, z, vx, vy, vz, pr, rho;
+};
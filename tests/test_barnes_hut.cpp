@@ -0,0 +1,33 @@
+#include "barnes_hut.h"
+#include "test_common.h"
+
+// Barnes-Hut field gradient against the O(N^2) sum on a random dipole cloud for a few opening angles
+int main() {
+    const double cutoff = 0.05;
+    const DipoleCloud cloud = random_dipoles(3000, 0.0f, 1.0f);
+    const auto reference = reference_gradient(cloud, cutoff);
+
+    BarnesHut bh;
+    bh.cutoff = cutoff;
+    for (double theta : {0.3, 0.5, 0.8}) {
+        bh.theta = theta;
+        bh.build(cloud.position.data(), cloud.moment.data(), cloud.size());
+        std::vector<Eigen::Matrix3d> grad(cloud.size(), Eigen::Matrix3d::Zero());
+        for (size_t t = 0; t < cloud.size(); t++) {
+            const glm::dvec3 rt(cloud.position[t]);
+            auto far = [&](const glm::dvec3 &position, const glm::dvec3 &moment) {
+                grad[t] += dipole_gradient(rt, position, moment);
+            };
+            auto near = [&](uint32_t s) {
+                const glm::dvec3 rs(cloud.position[s]);
+                if (s != t && glm::length(rt - rs) >= cutoff)
+                    grad[t] += dipole_gradient(rt, rs, glm::dvec3(cloud.moment[s]));
+            };
+            bh.for_each_source(rt, far, near);
+        }
+        char what[64];
+        snprintf(what, sizeof(what), "theta %.1f gradient", theta);
+        expect_below(what, relative_error(grad, reference), theta < 0.4 ? 3e-3 : theta < 0.6 ? 2e-2 : 1.5e-1);
+    }
+    return failures != 0;
+}
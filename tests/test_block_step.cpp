@@ -0,0 +1,66 @@
+#include "simulation.h"
+#include "test_common.h"
+#include <algorithm>
+
+// block time steps against uniform steps of the finest sub-step on a pool hit by a fast drop. The sound speed is
+// lowered so that the CFL limits of the drop and the pool fall on different levels.
+static Simulation scene() {
+    std::vector<vec3> particles, velocity;
+    for (float x = 0.3f; x < 0.7f; x += 0.02f)
+        for (float z = 0.3f; z < 0.7f; z += 0.02f)
+            for (float y = 0.0f; y < 0.06f; y += 0.01f)
+                particles.emplace_back(x, y, z);
+    velocity.resize(particles.size(), vec3(0.0f));
+    for (float x = 0.46f; x < 0.54f; x += 0.01f)
+        for (float z = 0.46f; z < 0.54f; z += 0.01f)
+            for (float y = 0.2f; y < 0.28f; y += 0.01f) {
+                particles.emplace_back(x, y, z);
+                velocity.emplace_back(0.0f, -4.0f, 0.0f);
+            }
+    Simulation sim(particles, velocity);
+    sim.c0 = 2.0f;
+    sim.enable_ferro = false;
+    sim.enable_gravity = true;
+    sim.lower = vec3(0.3f, 0.0f, 0.3f);
+    sim.upper = vec3(0.7f, 1.0f, 0.7f);
+    sim.block_timesteps = true;
+    sim.neighbor_skin = 0.2f * sim.dh;
+    return sim;
+}
+
+int main() {
+    const float dt = 0.004f, duration = 0.1f;
+    Simulation block = scene(), uniform = scene();
+    block.block_levels = 4;
+    block.dt = dt;
+    uniform.block_levels = 1;
+    uniform.dt = dt / 8;
+    int spread = 0;
+    while (block.sim_time < duration - 1e-6f) {
+        block.run_step();
+        const auto levels = std::minmax_element(block.block.level.begin(), block.block.level.end());
+        spread = std::max(spread, *levels.second - *levels.first);
+    }
+    expect_below("particles not on different levels", spread < 1, 1);
+    while (uniform.sim_time < duration - 1e-6f)
+        uniform.run_step();
+
+    // the splash is chaotic particle by particle, so the runs are compared through the centroid and the kinetic energy.
+    // Halving the uniform step alone moves the energy by 2%, the coarser steps of the pool by about 18%.
+    auto summary = [](const Simulation &sim, glm::dvec3 &centroid, double &energy) {
+        centroid = glm::dvec3(0.0);
+        energy = 0.0;
+        for (size_t i = 0; i < sim.num_particles; i++) {
+            const glm::dvec3 v(sim.pointers.particle_velocity[i]);
+            centroid += glm::dvec3(sim.pointers.particle_position[i]) / double(sim.num_particles);
+            energy += 0.5 * glm::dot(v, v) / double(sim.num_particles);
+        }
+    };
+    glm::dvec3 c_block, c_uniform;
+    double e_block, e_uniform;
+    summary(block, c_block, e_block);
+    summary(uniform, c_uniform, e_uniform);
+    expect_below("centroid difference / h", glm::length(c_block - c_uniform) / block.h, 0.02);
+    expect_below("kinetic energy difference", std::abs(e_block - e_uniform) / e_uniform, 0.3);
+    return failures != 0;
+}
@@ -0,0 +1,93 @@
+#include "collider.h"
+#include "test_common.h"
+#include <map>
+
+// unit icosphere subdivided sub times, scaled by radius and moved to center
+static void icosphere(int sub, double radius, const Eigen::RowVector3d &center, Eigen::MatrixXd &V,
+                      Eigen::MatrixXi &F) {
+    const double t = (1.0 + std::sqrt(5.0)) / 2.0;
+    std::vector<Eigen::RowVector3d> v = {{-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0}, {0, -1, t}, {0, 1, t},
+                                         {0, -1, -t}, {0, 1, -t}, {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1}};
+    for (auto &p : v)
+        p.normalize();
+    std::vector<Eigen::RowVector3i> f = {{0, 11, 5}, {0, 5, 1},  {0, 1, 7},   {0, 7, 10}, {0, 10, 11},
+                                         {1, 5, 9},  {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+                                         {3, 9, 4},  {3, 4, 2},  {3, 2, 6},   {3, 6, 8},  {3, 8, 9},
+                                         {4, 9, 5},  {2, 4, 11}, {6, 2, 10},  {8, 6, 7},  {9, 8, 1}};
+    for (int s = 0; s < sub; s++) {
+        std::map<std::pair<int, int>, int> midpoints;
+        auto midpoint = [&](int a, int b) {
+            auto key = std::minmax(a, b);
+            auto it = midpoints.find(key);
+            if (it != midpoints.end())
+                return it->second;
+            v.push_back((v[a] + v[b]).normalized());
+            return midpoints[key] = int(v.size()) - 1;
+        };
+        std::vector<Eigen::RowVector3i> next;
+        for (auto &x : f) {
+            const int a = midpoint(x[0], x[1]), b = midpoint(x[1], x[2]), c = midpoint(x[2], x[0]);
+            next.insert(next.end(), {{x[0], a, c}, {x[1], b, a}, {x[2], c, b}, {a, b, c}});
+        }
+        f = next;
+    }
+    V.resize(v.size(), 3);
+    F.resize(f.size(), 3);
+    for (size_t i = 0; i < v.size(); i++)
+        V.row(i) = radius * v[i] + center;
+    for (size_t i = 0; i < f.size(); i++)
+        F.row(i) = f[i];
+}
+
+// the baked distance of a sphere obstacle and a sphere container against the analytic one, and collisions resolved
+// from shallow and deep penetration
+int main() {
+    const double radius = 0.2;
+    const glm::vec3 center(0.5f);
+    Eigen::MatrixXd V;
+    Eigen::MatrixXi F;
+    icosphere(3, radius, Eigen::RowVector3d(0.5, 0.5, 0.5), V, F);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+    for (bool container : {false, true}) {
+        Collider collider;
+        collider.cell_size = 0.01;
+        collider.add_mesh(V, F, container);
+        collider.prepare();
+        // the flat faces of the icosphere sag at most 5e-4 below the sphere, well within the bound
+        double distance_error = 0.0, direction_error = 0.0;
+        for (int i = 0; i < 2000; i++) {
+            glm::vec3 d(u(rng), u(rng), u(rng));
+            if (glm::length(d) < 1e-3f)
+                continue;
+            d = glm::normalize(d);
+            const float offset = 0.9f * float(collider.band) * u(rng);
+            const glm::vec3 p = center + (float(radius) + offset) * d;
+            glm::vec3 g;
+            const float sdf = collider.distance(p, g);
+            distance_error = std::max(distance_error, double(std::abs(sdf - (container ? -offset : offset))));
+            if (glm::length(g) > 0.0f)
+                direction_error = std::max(direction_error, 1.0 - double(std::abs(glm::dot(glm::normalize(g), d))));
+        }
+        expect_below(container ? "container distance error / cell" : "obstacle distance error / cell",
+                     distance_error / collider.cell_size, 0.3);
+        expect_below(container ? "container gradient direction error" : "obstacle gradient direction error",
+                     direction_error, 0.01);
+
+        // shallow: onto the surface with the normal velocity reflected, deep: back to the previous position
+        const glm::vec3 outside = center + float(container ? 0.5 * radius : 1.5 * radius) * glm::vec3(0, 0, 1);
+        glm::vec3 p = center + float(radius + (container ? 0.01 : -0.01)) * glm::vec3(0, 0, 1);
+        glm::vec3 v(0.0f, 0.0f, container ? 1.0f : -1.0f);
+        collider.collide(p, v, 0.3f, outside);
+        glm::vec3 g;
+        expect_below(container ? "container shallow penetration" : "obstacle shallow penetration",
+                     std::max(0.0f, -collider.distance(p, g)), 0.2 * collider.cell_size);
+        expect_below("velocity still into the solid", container ? v.z > 0.0f : v.z < 0.0f, 1);
+        p = center + float(container ? 2.0 * radius : 0.2 * radius) * glm::vec3(0, 0, 1);
+        v = glm::vec3(0.0f, 0.0f, container ? 1.0f : -1.0f);
+        collider.collide(p, v, 0.3f, outside);
+        expect_below(container ? "container deep penetration" : "obstacle deep penetration",
+                     glm::length(p - outside), 1e-6);
+    }
+    return failures != 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <cmath>
+#include <cstdio>
+#include <glm/glm.hpp>
+#include <random>
+#include <vector>
+
+// Shared pieces of the accuracy tests. Every test is a plain executable that prints what it measured and exits
+// non-zero when a measurement is out of bounds, so that ctest reports it.
+
+inline int failures = 0;
+// records a failure unless value < bound, NaN fails
+inline void expect_below(const char *what, double value, double bound) {
+    const bool ok = value < bound;
+    printf("%s %s: %g (bound %g)\n", ok ? "ok  " : "FAIL", what, value, bound);
+    failures += !ok;
+}
+
+// n point dipoles uniformly in [lower, upper]^3 with moments of random direction and length up to 1
+struct DipoleCloud {
+    std::vector<glm::vec3> position, moment;
+    size_t size() const { return position.size(); }
+};
+inline DipoleCloud random_dipoles(size_t n, float lower, float upper, unsigned seed = 1) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> p(lower, upper), m(-1.0f, 1.0f);
+    DipoleCloud cloud;
+    for (size_t i = 0; i < n; i++) {
+        cloud.position.emplace_back(p(rng), p(rng), p(rng));
+        glm::vec3 d;
+        do {
+            d = glm::vec3(m(rng), m(rng), m(rng));
+        } while (glm::dot(d, d) > 1.0f);
+        cloud.moment.push_back(d);
+    }
+    return cloud;
+}
+
+// H and dH_i/dx_j at rt of a point dipole m at rs: H = (3 (m . r) r / r^5 - m / r^3) / (4 pi) with r = rt - rs
+inline Eigen::Vector3d dipole_field(const glm::dvec3 &rt, const glm::dvec3 &rs, const glm::dvec3 &m) {
+    const glm::dvec3 r = rt - rs;
+    const double r2 = glm::dot(r, r), r3 = r2 * std::sqrt(r2), mr = glm::dot(m, r);
+    const glm::dvec3 H = (3.0 * mr * r / r2 - m) / (4.0 * M_PI * r3);
+    return Eigen::Vector3d(H.x, H.y, H.z);
+}
+inline Eigen::Matrix3d dipole_gradient(const glm::dvec3 &rt, const glm::dvec3 &rs, const glm::dvec3 &m) {
+    const glm::dvec3 r = rt - rs;
+    const double r2 = glm::dot(r, r), r5 = r2 * r2 * std::sqrt(r2), mr = glm::dot(m, r);
+    Eigen::Matrix3d G;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            G(i, j) = 3.0 * (m[i] * r[j] + m[j] * r[i] + (i == j) * mr - 5.0 * mr * r[i] * r[j] / r2) /
+                      (4.0 * M_PI * r5);
+    return G;
+}
+
+// O(N^2) reference in double over every source at least cutoff away, near counts the closer ones per target
+inline std::vector<Eigen::Matrix3d> reference_gradient(const DipoleCloud &cloud, double cutoff,
+                                                       std::vector<size_t> *near = nullptr) {
+    std::vector<Eigen::Matrix3d> grad(cloud.size(), Eigen::Matrix3d::Zero());
+    if (near)
+        near->assign(cloud.size(), 0);
+    for (size_t t = 0; t < cloud.size(); t++) {
+        for (size_t s = 0; s < cloud.size(); s++) {
+            if (s == t)
+                continue;
+            const glm::dvec3 rt(cloud.position[t]), rs(cloud.position[s]);
+            if (glm::length(rt - rs) < cutoff) {
+                if (near)
+                    (*near)[t]++;
+                continue;
+            }
+            grad[t] += dipole_gradient(rt, rs, glm::dvec3(cloud.moment[s]));
+        }
+    }
+    return grad;
+}
+inline std::vector<Eigen::Vector3d> reference_field(const DipoleCloud &cloud, double cutoff) {
+    std::vector<Eigen::Vector3d> field(cloud.size(), Eigen::Vector3d::Zero());
+    for (size_t t = 0; t < cloud.size(); t++) {
+        for (size_t s = 0; s < cloud.size(); s++) {
+            const glm::dvec3 rt(cloud.position[t]), rs(cloud.position[s]);
+            if (s != t && glm::length(rt - rs) >= cutoff)
+                field[t] += dipole_field(rt, rs, glm::dvec3(cloud.moment[s]));
+        }
+    }
+    return field;
+}
+
+// sqrt(sum |a - b|^2 / sum |b|^2), Frobenius norms for matrices
+template <class T>
+double relative_error(const std::vector<T> &a, const std::vector<T> &b) {
+    double error = 0.0, norm = 0.0;
+    for (size_t i = 0; i < b.size(); i++) {
+        error += (a[i] - b[i]).squaredNorm();
+        norm += b[i].squaredNorm();
+    }
+    return std::sqrt(error / norm);
+}
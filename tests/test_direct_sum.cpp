@@ -0,0 +1,27 @@
+#include "direct_sum.h"
+#include "test_common.h"
+
+// the tiled float DipoleDirect against the plain O(N^2) sum in double, on more sources than one tile holds
+int main() {
+    const double cutoff = 0.05;
+    const DipoleCloud cloud = random_dipoles(2500, 0.0f, 1.0f);
+    std::vector<size_t> near_reference;
+    const auto grad_reference = reference_gradient(cloud, cutoff, &near_reference);
+    const auto field_reference = reference_field(cloud, cutoff);
+
+    DipoleDirect direct;
+    direct.cutoff = cutoff;
+    std::vector<size_t> near(cloud.size(), 0);
+    NearField count = [&](uint32_t t, uint32_t) { near[t]++; };
+    std::vector<Eigen::Matrix3d> grad(cloud.size());
+    direct.evaluate(cloud.position.data(), cloud.moment.data(), cloud.size(), count, grad.data());
+    expect_below("gradient", relative_error(grad, grad_reference), 1e-5);
+    size_t missed = 0;
+    for (size_t t = 0; t < cloud.size(); t++)
+        missed += near[t] != near_reference[t];
+    expect_below("targets with a wrong number of near pairs", missed, 1);
+    std::vector<Eigen::Vector3d> field(cloud.size());
+    direct.evaluate_field(cloud.position.data(), cloud.moment.data(), cloud.size(), NearField(), field.data());
+    expect_below("field", relative_error(field, field_reference), 1e-5);
+    return failures != 0;
+}
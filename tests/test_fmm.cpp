@@ -0,0 +1,34 @@
+#include "fmm.h"
+#include "test_common.h"
+
+// DipoleFMM against the O(N^2) sum on a random dipole cloud, including the pairs handed to the near callback
+int main() {
+    const double cutoff = 0.05;
+    const DipoleCloud cloud = random_dipoles(3000, 0.0f, 1.0f);
+    std::vector<size_t> near_reference;
+    const auto grad_reference = reference_gradient(cloud, cutoff, &near_reference);
+    const auto field_reference = reference_field(cloud, cutoff);
+
+    DipoleFMM fmm;
+    fmm.cutoff = cutoff;
+    std::vector<size_t> near(cloud.size(), 0);
+    NearField count = [&](uint32_t t, uint32_t) { near[t]++; };
+    for (int order : {2, 4, 6}) {
+        fmm.order = order;
+        std::vector<Eigen::Matrix3d> grad(cloud.size(), Eigen::Matrix3d::Zero());
+        std::fill(near.begin(), near.end(), 0);
+        fmm.evaluate(cloud.position.data(), cloud.moment.data(), cloud.size(), count, grad.data());
+        char what[64];
+        snprintf(what, sizeof(what), "order %d gradient", order);
+        expect_below(what, relative_error(grad, grad_reference), order == 2 ? 1e-2 : order == 4 ? 3e-3 : 1e-3);
+        size_t missed = 0;
+        for (size_t t = 0; t < cloud.size(); t++)
+            missed += near[t] != near_reference[t];
+        expect_below("targets with a wrong number of near pairs", missed, 1);
+    }
+    fmm.order = 4;
+    std::vector<Eigen::Vector3d> field(cloud.size(), Eigen::Vector3d::Zero());
+    fmm.evaluate_field(cloud.position.data(), cloud.moment.data(), cloud.size(), count, field.data());
+    expect_below("order 4 field", relative_error(field, field_reference), 6e-3);
+    return failures != 0;
+}
@@ -0,0 +1,40 @@
+#include "simulation.h"
+#include "test_common.h"
+
+// the IISPH solve keeps a settling block of fluid near rest density at a step where the Tait equation compresses it
+// by about 1% on average
+int main() {
+    std::vector<vec3> particles;
+    for (float x = 0.3f; x < 0.7f; x += 0.02f)
+        for (float z = 0.3f; z < 0.7f; z += 0.02f)
+            for (float y = 0.0f; y < 0.1f; y += 0.01f)
+                particles.emplace_back(x, y, z);
+    Simulation sim(particles);
+    sim.enable_ferro = false;
+    sim.enable_gravity = true;
+    sim.dt = 0.004f;
+    sim.pressure_solver = PressureSolver::Implicit;
+    sim.pressure_omega_interval = 10; // re-estimated a few times during the test
+    sim.log_pressure_solve = false;
+    sim.lower = vec3(0.3f, 0.0f, 0.3f);
+    sim.upper = vec3(0.7f, 1.0f, 0.7f);
+    double average = 0.0, largest = 0.0;
+    bool finite = true;
+    const int steps = 60;
+    for (int i = 0; i < steps; i++) {
+        sim.run_step();
+        double sum = 0.0;
+        for (size_t id = 0; id < sim.num_particles; id++) {
+            const double compression = std::max(0.0, (double(sim.pointers.density[id]) - sim.rho0) / sim.rho0);
+            sum += compression;
+            largest = std::max(largest, compression);
+            finite = finite && std::isfinite(sim.pointers.particle_velocity[id].y);
+        }
+        average += sum / sim.num_particles / steps;
+    }
+    expect_below("non-finite velocities", !finite, 1);
+    expect_below("relaxation estimated", sim.implicit_pressure.omega <= 0.0f, 1);
+    expect_below("average compression", average, sim.pressure_tolerance);
+    expect_below("largest compression", largest, 5e-3);
+    return failures != 0;
+}
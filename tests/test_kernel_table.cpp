@@ -0,0 +1,45 @@
+#include "simulation.h"
+#include "test_common.h"
+
+// the kernel tables against the analytic kernels, directly and through the SPH rates of a settling block of fluid
+int main() {
+    std::vector<vec3> particles;
+    for (float x = 0.3f; x < 0.7f; x += 0.02f)
+        for (float z = 0.3f; z < 0.7f; z += 0.02f)
+            for (float y = 0.0f; y < 0.1f; y += 0.01f)
+                particles.emplace_back(x, y, z);
+    Simulation sim(particles);
+    sim.enable_ferro = false;
+    sim.enable_gravity = true;
+    sim.dt = 0.004f;
+    sim.lower = vec3(0.3f, 0.0f, 0.3f);
+    sim.upper = vec3(0.7f, 1.0f, 0.7f);
+    for (int i = 0; i < 10; i++)
+        sim.run_step();
+
+    sim.enable_gravity = false;
+    sim.update_neighbors();
+    std::vector<Eigen::Vector3d> analytic(sim.num_particles), tabulated(sim.num_particles);
+    auto rates = [&](std::vector<Eigen::Vector3d> &dvdt) {
+        sim.compute_dvdt();
+        for (size_t id = 0; id < sim.num_particles; id++) {
+            const vec3 a = sim.pointers.dvdt[id];
+            dvdt[id] = Eigen::Vector3d(a.x, a.y, a.z);
+        }
+    };
+    rates(analytic);
+    sim.use_kernel_tables = true;
+    sim.update_kernel_tables();
+    expect_below("tables ready", !sim.kernel_tables_ready(), 1);
+    expect_below("largest table error", sim.check_kernel_tables(), 1e-3);
+    rates(tabulated);
+    expect_below("dvdt", relative_error(tabulated, analytic), 2e-4);
+
+    // rebuilt for a new smoothing length
+    sim.h *= 0.7f;
+    sim.dh *= 0.7f;
+    sim.update_kernel_tables();
+    expect_below("table h follows", std::abs(sim.kernel_tables.h - sim.h), 1e-9);
+    expect_below("largest table error after a change of h", sim.check_kernel_tables(), 1e-3);
+    return failures != 0;
+}
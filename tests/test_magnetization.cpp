@@ -0,0 +1,31 @@
+#include "simulation.h"
+#include "test_common.h"
+
+// the matrix-free magnetization operator with every magnetic solver against the direct sum, on a block of fluid and a
+// random moment vector
+int main() {
+    std::vector<vec3> particles;
+    for (float x = 0.3f; x < 0.7f; x += 0.02f)
+        for (float z = 0.3f; z < 0.7f; z += 0.02f)
+            for (float y = 0.0f; y < 0.1f; y += 0.01f)
+                particles.emplace_back(x, y, z);
+    Simulation sim(particles);
+    sim.update_neighbors();
+    std::mt19937 rng(1);
+    std::normal_distribution<double> normal;
+    Eigen::VectorXd x(3 * sim.num_particles), reference, y;
+    for (Eigen::Index i = 0; i < x.size(); i++)
+        x[i] = normal(rng);
+    sim.magnetic_solver = MagneticSolver::Direct;
+    sim.apply_magnetization_operator(x, reference);
+    // relative to the field part G Gamma x, the identity would hide the error
+    const std::pair<MagneticSolver, double> solvers[] = {
+        {MagneticSolver::FMM, 5e-3}, {MagneticSolver::BarnesHut, 0.1}, {MagneticSolver::P3M, 1e-3}};
+    const char *names[] = {"FMM", "Barnes-Hut", "P3M"};
+    for (int i = 0; i < 3; i++) {
+        sim.magnetic_solver = solvers[i].first;
+        sim.apply_magnetization_operator(x, y);
+        expect_below(names[i], (y - reference).norm() / (reference - x).norm(), solvers[i].second);
+    }
+    return failures != 0;
+}
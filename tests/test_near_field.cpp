@@ -0,0 +1,40 @@
+#include "near_field.h"
+#include "test_common.h"
+
+// NearFieldTensor against the appendix form R T_hat R^T, built pair by pair in double in a rotated frame whose
+// third axis is n = (rt - rs) / |rt - rs|
+static Eigen::Matrix3d rotated_frame_tensor(const glm::dvec3 &r, const glm::dvec3 &m, double h) {
+    float C1, C2;
+    NearFieldTensor::curves(float(glm::length(r) / h), C1, C2);
+    const glm::dvec3 n = glm::normalize(r);
+    const glm::dvec3 a = std::abs(n.z) < 0.9 ? glm::dvec3(0, 0, 1) : glm::dvec3(1, 0, 0);
+    const glm::dvec3 e1 = glm::normalize(glm::cross(a, n)), e2 = glm::cross(n, e1);
+    Eigen::Matrix3d R;
+    R << e1.x, e2.x, n.x, e1.y, e2.y, n.y, e1.z, e2.z, n.z;
+    const Eigen::Vector3d m_hat = R.transpose() * Eigen::Vector3d(m.x, m.y, m.z);
+    Eigen::Matrix3d T_hat;
+    T_hat << m_hat[2] * C1, 0.0, m_hat[0] * C1, 0.0, m_hat[2] * C1, m_hat[1] * C1, m_hat[0] * C1, m_hat[1] * C1,
+        m_hat[2] * C2;
+    return R * T_hat * R.transpose() / (h * h * h * h);
+}
+
+int main() {
+    const double h = 0.02;
+    const DipoleCloud cloud = random_dipoles(4000, 0.0f, 0.3f);
+    std::vector<Eigen::Matrix3d> reference(cloud.size(), Eigen::Matrix3d::Zero());
+    for (size_t t = 0; t < cloud.size(); t++) {
+        for (size_t s = 0; s < cloud.size(); s++) {
+            const glm::dvec3 r = glm::dvec3(cloud.position[t]) - glm::dvec3(cloud.position[s]);
+            const double d = glm::length(r);
+            if (s != t && d > 0.0 && d < 4.0 * h)
+                reference[t] += rotated_frame_tensor(r, glm::dvec3(cloud.moment[s]), h);
+        }
+    }
+    NearFieldTensor near_field;
+    near_field.h = float(h);
+    near_field.build(cloud.position.data(), cloud.moment.data(), cloud.size());
+    std::vector<Eigen::Matrix3d> U(cloud.size(), Eigen::Matrix3d::Zero());
+    near_field.evaluate(U.data());
+    expect_below("near field tensor", relative_error(U, reference), 1e-5);
+    return failures != 0;
+}
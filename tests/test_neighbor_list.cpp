@@ -0,0 +1,38 @@
+#include "neighbor_list.h"
+#include "test_common.h"
+#include <algorithm>
+
+// compressed against plain neighbor lists on random lists of mostly nearby ids with a few far ones, so that every
+// varint length and negative first offsets occur; compression sorts the lists, so they are compared as sets
+int main() {
+    const size_t n = 50000;
+    std::mt19937 rng(1);
+    std::vector<std::vector<uint32_t>> lists(n);
+    for (size_t i = 0; i < n; i++) {
+        const int count = rng() % 60;
+        for (int k = 0; k < count; k++) {
+            const size_t range = rng() % 16 == 0 ? n : 400;
+            lists[i].push_back(uint32_t((i + n + rng() % range - range / 2) % n));
+        }
+    }
+    auto count = [&](size_t i) { return lists[i].size(); };
+    auto fill = [&](size_t i, uint32_t *out) { std::copy(lists[i].begin(), lists[i].end(), out); };
+    NeighborList plain, packed;
+    packed.compressed = true;
+    for (int build = 0; build < 2; build++) {
+        plain.build(n, count, fill);
+        packed.build(n, count, fill);
+        size_t mismatches = 0;
+        for (size_t i = 0; i < n; i++) {
+            std::vector<uint32_t> a, b, expected = lists[i];
+            plain.for_each(i, [&](uint32_t j) { a.push_back(j); });
+            packed.for_each(i, [&](uint32_t j) { b.push_back(j); });
+            mismatches += a != lists[i] || packed.count(i) != expected.size();
+            std::sort(expected.begin(), expected.end());
+            mismatches += b != expected;
+        }
+        expect_below("lists that differ", mismatches, 1);
+        expect_below("compressed / plain memory", double(packed.memory()) / plain.memory(), 0.6);
+    }
+    return failures != 0;
+}
@@ -0,0 +1,41 @@
+#include "p3m.h"
+#include "test_common.h"
+
+// DipoleP3M against the O(N^2) sum on a random dipole cloud, including the pairs handed to the near callback
+int main() {
+    const double cutoff = 0.05;
+    const DipoleCloud cloud = random_dipoles(3000, 0.0f, 0.5f);
+    std::vector<size_t> near_reference;
+    const auto reference = reference_gradient(cloud, cutoff, &near_reference);
+    const auto field_reference = reference_field(cloud, cutoff);
+
+    DipoleP3M p3m;
+    p3m.cutoff = cutoff;
+    std::vector<size_t> near(cloud.size(), 0);
+    NearField count = [&](uint32_t t, uint32_t) { near[t]++; };
+    for (double cell_size : {0.02, 0.01}) {
+        p3m.cell_size = cell_size;
+        p3m.splitting = 0.3;
+        std::vector<Eigen::Matrix3d> grad(cloud.size());
+        std::fill(near.begin(), near.end(), 0);
+        p3m.evaluate(cloud.position.data(), cloud.moment.data(), cloud.size(), count, grad.data());
+        char what[64];
+        snprintf(what, sizeof(what), "cell size %.2f gradient", cell_size);
+        expect_below(what, relative_error(grad, reference), cell_size > 0.015 ? 1.5e-3 : 7e-3);
+        size_t missed = 0;
+        for (size_t t = 0; t < cloud.size(); t++)
+            missed += near[t] != near_reference[t];
+        expect_below("targets with a wrong number of near pairs", missed, 1);
+
+        std::vector<Eigen::Vector3d> field(cloud.size());
+        std::fill(near.begin(), near.end(), 0);
+        p3m.evaluate_field(cloud.position.data(), cloud.moment.data(), cloud.size(), count, field.data());
+        snprintf(what, sizeof(what), "cell size %.2f field", cell_size);
+        expect_below(what, relative_error(field, field_reference), cell_size > 0.015 ? 2e-3 : 5e-3);
+        missed = 0;
+        for (size_t t = 0; t < cloud.size(); t++)
+            missed += near[t] != near_reference[t];
+        expect_below("targets with a wrong number of near pairs in the field", missed, 1);
+    }
+    return failures != 0;
+}
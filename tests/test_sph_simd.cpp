@@ -0,0 +1,46 @@
+#include "simulation.h"
+#include "test_common.h"
+
+// the SoA float SIMD neighbor loops against the scalar SPH rates on a settling block of fluid
+int main() {
+    std::vector<vec3> particles;
+    for (float x = 0.3f; x < 0.7f; x += 0.02f)
+        for (float z = 0.3f; z < 0.7f; z += 0.02f)
+            for (float y = 0.0f; y < 0.1f; y += 0.01f)
+                particles.emplace_back(x, y, z);
+    Simulation sim(particles);
+    sim.enable_ferro = false;
+    sim.enable_gravity = true;
+    sim.dt = 0.004f;
+    sim.lower = vec3(0.3f, 0.0f, 0.3f);
+    sim.upper = vec3(0.7f, 1.0f, 0.7f);
+    // a few steps so that velocities and densities vary
+    for (int i = 0; i < 10; i++)
+        sim.run_step();
+
+    // without gravity, which both add alike and would hide the error of the neighbor sums
+    sim.enable_gravity = false;
+    sim.update_neighbors();
+    std::vector<Eigen::Vector3d> dvdt_scalar(sim.num_particles), dvdt_simd(sim.num_particles);
+    std::vector<Eigen::Matrix<double, 1, 1>> drhodt_scalar(sim.num_particles), drhodt_simd(sim.num_particles);
+    sim.simd_sph = false;
+    sim.compute_dvdt();
+    for (size_t id = 0; id < sim.num_particles; id++) {
+        const vec3 a = sim.pointers.dvdt[id];
+        dvdt_scalar[id] = Eigen::Vector3d(a.x, a.y, a.z);
+        drhodt_scalar[id][0] = sim.drhodt(id);
+    }
+    sim.simd_sph = true;
+    expect_below("SIMD loops not taken", !sim.use_simd_sph(), 1);
+    sim.compute_dvdt();
+    const auto constants = sim.sph_constants();
+    for (size_t id = 0; id < sim.num_particles; id++) {
+        const vec3 a = sim.pointers.dvdt[id];
+        dvdt_simd[id] = Eigen::Vector3d(a.x, a.y, a.z);
+        drhodt_simd[id][0] = sim.sph_simd.drhodt(constants, uint32_t(id), sim.neighbors.list(id),
+                                                 sim.neighbors.count(id));
+    }
+    expect_below("dvdt", relative_error(dvdt_simd, dvdt_scalar), 1e-5);
+    expect_below("drhodt", relative_error(drhodt_simd, drhodt_scalar), 1e-5);
+    return failures != 0;
+}